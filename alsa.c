@@ -0,0 +1,345 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * ALSA capture source, built with "make ALSA=1".  The receiver output is
+ * wired to a sound card input (an I2S or PCM codec, or a USB line in) and
+ * captured as audio, so sample timing comes from the card's crystal and DMA
+ * rather than from busy waiting on the CPU clock.  Time is the count of audio
+ * frames captured, so the source runs on the card's clock like the simulator
+ * runs on its virtual one, and waiting is a blocking read that uses no CPU.
+ *
+ * Each SAMP_PERIOD slot of audio is reduced to one sample, the majority of
+ * its frames above a threshold midway between the recent highest and lowest
+ * levels, which follows a DC offset or an AC coupled input's sag.  The loops
+ * over a slot's frames are plain counts and min/max, which the compiler
+ * vectorizes with CFLAGS=-O3.  read() returns the last whole slot before
+ * now.  -I inverts the level for inputs that invert.  An overrun (frames lost
+ * when the decoder did not read in time) is recovered from with a warning,
+ * and the clock slips by the frames lost.
+ *
+ * -q device plays the simulated receiver to an ALSA playback device, so the
+ * whole path can be tried on any Linux machine with the snd-aloop loopback:
+ *
+ *   modprobe snd-aloop
+ *   wwvb_dec -s 2 -q hw:Loopback,0,0 &
+ *   wwvb_dec -a hw:Loopback,1,0 -C
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wwvb_dec.h"
+
+char *alsa_device;
+uint32_t alsa_rate = 48000;
+int alsa_invert;
+
+#ifdef WWVB_ALSA
+
+#include <alsa/asoundlib.h>
+
+/* Frames read at most at a time, 10 ms at 48 kHz */
+#define ALSA_CHUNK 480
+
+/* Buffer the card may fill before an overrun, usec */
+#define ALSA_LATENCY_USEC 500000
+
+/* Capture level, 0 to 32767, that playback uses for a high output */
+#define ALSA_PLAY_LEVEL 16384
+
+static snd_pcm_t *alsa_pcm;
+static uint32_t alsa_channels;
+static int16_t alsa_buf[2*ALSA_CHUNK];
+static int16_t alsa_mono[ALSA_CHUNK];
+
+static uint64_t alsa_frames;         /* frames taken from the card */
+static uint64_t alsa_slot;           /* slot being filled */
+static uint64_t alsa_slot_end;       /* first frame after it */
+static uint64_t alsa_slot_start;
+static uint32_t alsa_ones;
+static int32_t alsa_max, alsa_min;   /* of the slot so far */
+static int32_t alsa_hi, alsa_lo, alsa_thresh;
+static uint32_t alsa_level;
+static uint32_t alsa_xruns;
+
+static uint64_t alsa_usec(uint64_t frames)
+{
+  return frames*1000000/alsa_rate;
+}
+
+/* Frame at which slot k starts, slots need not be a whole number of frames */
+
+static uint64_t alsa_slot_frame(uint64_t k)
+{
+  return k*alsa_rate*SAMP_PERIOD/1000;
+}
+
+/* Open device for capture, or playback, of S16 at alsa_rate, mono if the
+ * card allows */
+
+static int alsa_pcm_open(char *device, snd_pcm_stream_t stream)
+{
+  int err;
+
+  if (alsa_rate*SAMP_PERIOD/1000 < 2) {
+    fprintf(stderr, "Error: audio rate %u too low\n", alsa_rate);
+    return -1;
+  }
+  if ((err = snd_pcm_open(&alsa_pcm, device, stream, 0)) < 0) {
+    fprintf(stderr, "Error: could not open ALSA device %s: %s\n", device, snd_strerror(err));
+    return -1;
+  }
+
+  /* No resampling, the card's own clock is the point */
+  for (alsa_channels = 1; alsa_channels <= 2; alsa_channels++) {
+    if ((err = snd_pcm_set_params(alsa_pcm, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED,
+				  alsa_channels, alsa_rate, 0, ALSA_LATENCY_USEC)) == 0)
+      return 0;
+  }
+
+  fprintf(stderr, "Error: ALSA device %s does not do 16 bit %u Hz: %s\n", device, alsa_rate,
+	  snd_strerror(err));
+  snd_pcm_close(alsa_pcm);
+  alsa_pcm = NULL;
+  return -1;
+}
+
+static int alsa_open(void)
+{
+  if (alsa_pcm_open(alsa_device, SND_PCM_STREAM_CAPTURE) < 0) return -1;
+
+  alsa_frames = 0;
+  alsa_slot = 0;
+  alsa_slot_start = 0;
+  alsa_slot_end = alsa_slot_frame(1);
+  alsa_ones = 0;
+  alsa_max = -32768;
+  alsa_min = 32767;
+  alsa_hi = alsa_lo = alsa_thresh = 0;
+  alsa_level = 0;
+  alsa_xruns = 0;
+
+  if (snd_pcm_start(alsa_pcm) < 0) {
+    fprintf(stderr, "Error: could not start capture on %s\n", alsa_device);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void alsa_close(void)
+{
+  if (alsa_pcm == NULL) return;
+  snd_pcm_close(alsa_pcm);
+  alsa_pcm = NULL;
+  if (alsa_xruns > 0) printf("  ALSA: %u overrun(s)\n", alsa_xruns);
+}
+
+/* A slot is complete, decide its level and move the threshold */
+
+static void alsa_slot_done(void)
+{
+  uint32_t len = alsa_slot_end - alsa_slot_start, level;
+
+  level = (2*alsa_ones > len) ^ alsa_invert;
+  if (edgelog_enabled && level != alsa_level) edgelog_edge(alsa_usec(alsa_slot_end), level);
+  alsa_level = level;
+
+  /* The extremes decay toward each other a little every slot */
+  alsa_hi = alsa_max > alsa_hi ? alsa_max : alsa_hi - (alsa_hi - alsa_lo)/256;
+  alsa_lo = alsa_min < alsa_lo ? alsa_min : alsa_lo + (alsa_hi - alsa_lo)/256;
+  alsa_thresh = (alsa_hi + alsa_lo)/2;
+
+  alsa_slot++;
+  alsa_slot_start = alsa_slot_end;
+  alsa_slot_end = alsa_slot_frame(alsa_slot + 1);
+  alsa_ones = 0;
+  alsa_max = -32768;
+  alsa_min = 32767;
+}
+
+/* Reduce n frames of mono audio into slots */
+
+static void alsa_take(int16_t *p, uint32_t n)
+{
+  uint32_t i, k, ones;
+  int32_t mx, mn, thresh;
+
+  while (n > 0) {
+    k = alsa_slot_end - alsa_frames;
+    if (k > n) k = n;
+
+    ones = 0;
+    mx = alsa_max;
+    mn = alsa_min;
+    thresh = alsa_thresh;
+    for (i = 0; i < k; i++) {
+      ones += p[i] > thresh;
+      mx = p[i] > mx ? p[i] : mx;
+      mn = p[i] < mn ? p[i] : mn;
+    }
+    alsa_ones += ones;
+    alsa_max = mx;
+    alsa_min = mn;
+
+    alsa_frames += k;
+    p += k;
+    n -= k;
+    if (alsa_frames == alsa_slot_end) alsa_slot_done();
+  }
+}
+
+/* Read up to want frames from the card, blocking until there are some */
+
+static void alsa_fill(uint32_t want)
+{
+  snd_pcm_sframes_t n;
+  uint32_t i;
+
+  if (want > ALSA_CHUNK) want = ALSA_CHUNK;
+  if (want == 0) want = 1;
+
+  n = snd_pcm_readi(alsa_pcm, alsa_buf, want);
+  if (n == -EPIPE || n == -ESTRPIPE || n == -EINTR) {
+    if (n != -EINTR) {
+      alsa_xruns++;
+      fprintf(stderr, "Warning: ALSA capture overrun, samples lost\n");
+    }
+    if ((n = snd_pcm_recover(alsa_pcm, n, 1)) == 0) return;
+  }
+  if (n < 0) {
+    fprintf(stderr, "Error: ALSA capture failed: %s\n", snd_strerror(n));
+    wwvb_stop = 1;
+    return;
+  }
+
+  if (alsa_channels == 1) {
+    alsa_take(alsa_buf, n);
+  } else {
+    for (i = 0; i < (uint32_t)n; i++) alsa_mono[i] = alsa_buf[2*i];
+    alsa_take(alsa_mono, n);
+  }
+}
+
+/* The card's time, including frames captured but not yet read */
+
+static uint64_t alsa_now(void)
+{
+  snd_pcm_sframes_t avail = snd_pcm_avail(alsa_pcm);
+
+  return alsa_usec(alsa_frames + (avail > 0 ? avail : 0));
+}
+
+static uint64_t alsa_realtime(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+}
+
+static void alsa_wait_until(uint64_t usec)
+{
+  uint64_t frame = (usec*alsa_rate + 999999)/1000000;
+
+  while (alsa_frames < frame && !wwvb_stop) alsa_fill(frame - alsa_frames);
+}
+
+static void alsa_sleep(uint64_t usec)
+{
+  alsa_wait_until(alsa_usec(alsa_frames) + usec);
+}
+
+static uint32_t alsa_read(void)
+{
+  return alsa_level;
+}
+
+/* PDN is on a GPIO, which this source does not drive */
+
+static void alsa_power(int on)
+{
+}
+
+source_t alsa_source = {"alsa", alsa_open, alsa_close, alsa_now, alsa_realtime, alsa_wait_until,
+			alsa_sleep, alsa_read, alsa_power};
+
+/* Play the simulated receiver to device for count minutes (forever if 0) */
+
+int alsa_play(char *device, uint32_t count)
+{
+  static int16_t buf[2*ALSA_CHUNK];
+  uint64_t k, start, end, t;
+  uint32_t i, j, n, level;
+  snd_pcm_sframes_t w;
+
+  if (alsa_pcm_open(device, SND_PCM_STREAM_PLAYBACK) < 0) return -1;
+  if (sim_source.open() < 0) return -1;
+
+  printf("Playing the simulated receiver to %s at %u Hz\n", device, alsa_rate);
+  for (k = 0; (count == 0 || k < (uint64_t)count*60*SAMPLES_PER_SEC) && !wwvb_stop; k++) {
+    sim_source.wait_until(k*SAMP_PERIOD_USEC);
+    level = sim_source.read() ^ alsa_invert;
+
+    start = alsa_slot_frame(k);
+    end = alsa_slot_frame(k + 1);
+    for (t = start; t < end && !wwvb_stop; t += n) {
+      n = end - t > ALSA_CHUNK ? ALSA_CHUNK : end - t;
+      for (i = 0; i < n; i++)
+	for (j = 0; j < alsa_channels; j++) buf[alsa_channels*i + j] = level ? ALSA_PLAY_LEVEL : -ALSA_PLAY_LEVEL;
+      if ((w = snd_pcm_writei(alsa_pcm, buf, n)) < 0 && snd_pcm_recover(alsa_pcm, w, 0) < 0) {
+	fprintf(stderr, "Error: ALSA playback failed: %s\n", snd_strerror(w));
+	snd_pcm_close(alsa_pcm);
+	return -1;
+      }
+    }
+  }
+
+  snd_pcm_drain(alsa_pcm);
+  snd_pcm_close(alsa_pcm);
+  alsa_pcm = NULL;
+  return 0;
+}
+
+#else
+
+static int alsa_open(void)
+{
+  fprintf(stderr, "Error: built without ALSA, rebuild with \"make ALSA=1\"\n");
+  return -1;
+}
+
+static void alsa_close(void)
+{
+}
+
+static uint64_t alsa_now(void)
+{
+  return 0;
+}
+
+static void alsa_wait_until(uint64_t usec)
+{
+}
+
+static uint32_t alsa_read(void)
+{
+  return 0;
+}
+
+static void alsa_power(int on)
+{
+}
+
+source_t alsa_source = {"alsa", alsa_open, alsa_close, alsa_now, alsa_now, alsa_wait_until,
+			alsa_wait_until, alsa_read, alsa_power};
+
+int alsa_play(char *device, uint32_t count)
+{
+  return alsa_open();
+}
+
+#endif
@@ -0,0 +1,96 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Engine benchmark.  Every engine searches for and decodes the frame of each
+ * recorded sample file, from a cold start as after a capture, repeatedly.
+ * The time per decode is reported with the speedup over the byte by byte xor
+ * engine, and every engine's frame and decode are checked against it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wwvb_dec.h"
+
+#define BENCH_REPS 20
+
+static uint64_t bench_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+}
+
+/* Search and decode the buffer with the current engine, returning the frame
+ * start, search score, and decode score */
+
+static void bench_decode(uint32_t *frame_idx, uint32_t *min_val, uint32_t *score)
+{
+  engine_invalidate(0);
+  *frame_idx = find_frame(BLEN, min_val);
+  *score = decode_frame(*frame_idx);
+}
+
+static uint8_t bench_files[256][BLEN];
+static uint32_t bench_ref[256][3];
+static uint32_t bench_nfiles;
+
+/* Time engine e over all the files, printing a row of the table */
+
+static uint64_t bench_engine(engine_t *e, uint64_t xor_usec)
+{
+  uint32_t res[3], f, r, n, mismatches = 0;
+  uint64_t t, usec = 0;
+
+  engine = e;
+  for (f = 0; f < bench_nfiles; f++) {
+    memcpy(bits, bench_files[f], BLEN);
+    t = bench_usec();
+    for (r = 0; r < BENCH_REPS; r++) bench_decode(&res[0], &res[1], &res[2]);
+    usec += bench_usec() - t;
+    for (n = 0; n < 3; n++) mismatches += res[n] != bench_ref[f][n];
+  }
+  if (xor_usec == 0) xor_usec = usec;
+
+  printf("  %-10s %14.1f %7.2fx %11u\n", e->name, usec/(double)(bench_nfiles*BENCH_REPS),
+	 usec > 0 ? xor_usec/(double)usec : 0.0, mismatches);
+
+  return usec;
+}
+
+/* Benchmark every engine on the sample files fnames */
+
+int bench_run(char **fnames, uint32_t nfiles)
+{
+  uint32_t f, i;
+  uint64_t xor_usec;
+  engine_t *saved = engine;
+
+  if (nfiles == 0 || nfiles > 256) {
+    fprintf(stderr, "Error: benchmark needs 1 to 256 sample files\n");
+    return -1;
+  }
+  bench_nfiles = nfiles;
+
+  engine = &xor_engine;
+  for (f = 0; f < nfiles; f++) {
+    fill_buffer_file(fnames[f]);
+    memcpy(bench_files[f], bits, BLEN);
+    bench_decode(&bench_ref[f][0], &bench_ref[f][1], &bench_ref[f][2]);
+  }
+
+  printf("Engine benchmark, %u files, %u decodes each\n", nfiles, BENCH_REPS);
+  printf("  %-10s %14s %8s %11s\n", "engine", "usec/decode", "speedup", "mismatches");
+
+  /* The reference first, for the speedups */
+  xor_usec = bench_engine(&xor_engine, 0);
+  for (i = 0; engine_nth(i) != NULL; i++)
+    if (engine_nth(i) != &xor_engine) bench_engine(engine_nth(i), xor_usec);
+
+  engine = saved;
+  return 0;
+}
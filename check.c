@@ -0,0 +1,270 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Differential check of the scoring engines.  The reference is the original
+ * scalar code: xor_sec() for every second, and a frame search that scores
+ * every start sample in full with xor_frame() on the xor engine, keeping the
+ * first of equal scores.  Each engine must give the same score for every
+ * second of the buffer against all three symbols, the same frame start and
+ * score from find_frame() and from find_frame_from() run a second at a time
+ * as the adaptive capture does, and the same value, score and worst second
+ * for every field of the decode.  Scores are compared in the engine's units,
+ * the reference times the engine's one.  llr only scores as xor without a
+ * table, so it is skipped once one is loaded.
+ *
+ * The buffers are the sample files given, then random samples, frames
+ * encoded at random offsets with random noise, and buffers built to tie:
+ * constant levels and one second repeated, where many starts score the same.
+ * A buffer that fails is saved as check_fail_N.bin for -i.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wwvb_dec.h"
+
+/* Kinds of generated buffer, CHECK_KINDS of them */
+#define CHECK_RANDOM 0
+#define CHECK_FRAME 1
+#define CHECK_TIE 2
+
+static const char *check_kind_name[CHECK_KINDS] = {"random", "frame", "tie"};
+
+typedef struct {
+  uint32_t frame_idx, min_val, score;
+  uint32_t value[NUM_FIELDS], field_score[NUM_FIELDS], worst[NUM_FIELDS];
+} check_result_t;
+
+typedef struct {
+  uint64_t usec;
+  uint32_t mismatches;
+} check_stats_t;
+
+static uint32_t check_failures;
+
+static uint64_t check_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+}
+
+/* The original search: every start scored in full, first minimum wins */
+
+static uint32_t check_ref_find(uint32_t len, uint32_t *min_val)
+{
+  uint32_t samp_idx, res, min_idx = BLEN + BLEN;
+
+  *min_val = SAMPLES_PER_SEC * 120;
+  for (samp_idx = 0; samp_idx + SAMPLES_PER_SEC*60 < len; samp_idx++) {
+    res = xor_frame(samp_idx, 0xffffffff);
+    if (res < *min_val) {
+      *min_val = res;
+      min_idx = samp_idx;
+    }
+  }
+
+  return min_idx;
+}
+
+static void check_decode(check_result_t *r)
+{
+  uint32_t i;
+
+  r->score = decode_frame(r->frame_idx);
+  for (i = 0; i < NUM_FIELDS; i++) {
+    r->value[i] = frame[i].value;
+    r->field_score[i] = frame[i].score;
+    r->worst[i] = frame[i].worst_score;
+  }
+}
+
+static void check_fail(uint32_t n, const char *kind, engine_t *e, const char *what)
+{
+  char fname[64];
+
+  if (check_failures < 10) {
+    snprintf(fname, sizeof(fname), "check_fail_%u.bin", check_failures);
+    save_buffer_file(fname);
+    fprintf(stderr, "Error: %s engine, %s buffer %u: %s differs, saved as %s\n",
+	    e->name, kind, n, what, fname);
+  }
+  check_failures++;
+}
+
+/* Check engine e on the buffer against the reference result ref */
+
+static uint32_t check_engine(engine_t *e, check_result_t *ref, uint32_t len, uint32_t n,
+			     const char *kind, check_stats_t *stats)
+{
+  check_result_t r;
+  uint32_t i, sym, from, idx, val, fails = check_failures, one = e->one;
+  static const uint32_t low[3] = {200/SAMP_PERIOD, 500/SAMP_PERIOD, 800/SAMP_PERIOD};
+  uint64_t t;
+
+  engine = e;
+
+  /* Timed like a decode after a capture, from a cold start */
+  engine_invalidate(0);
+  t = check_usec();
+  r.frame_idx = find_frame(len, &r.min_val);
+  check_decode(&r);
+  stats->usec += check_usec() - t;
+
+  if (r.frame_idx != ref->frame_idx || r.min_val != ref->min_val*one)
+    check_fail(n, kind, e, "find_frame()");
+  if (r.score != ref->score*one)
+    check_fail(n, kind, e, "decode score");
+  for (i = 0; i < NUM_FIELDS; i++)
+    if (r.value[i] != ref->value[i] || r.field_score[i] != ref->field_score[i]*one ||
+	r.worst[i] != ref->worst[i]*one) {
+      check_fail(n, kind, e, frame[i].name);
+      break;
+    }
+
+  /* Every second, with the table built from the end of the buffer down to
+   * catch windows scored before their samples were valid */
+  engine_invalidate(0);
+  for (i = BLEN - SAMPLES_PER_SEC + 1; i-- > 0; )
+    for (sym = 0; sym < 3; sym++)
+      if (engine->score(i, sym) != xor_sec(i, low[sym], SAMPLES_PER_SEC - low[sym])*one) {
+	check_fail(n, kind, e, "second score");
+	i = 0;
+	break;
+      }
+
+  /* A second at a time, as the adaptive capture searches */
+  engine_invalidate(0);
+  idx = BLEN + BLEN;
+  val = SAMPLES_PER_SEC * 120 * one;
+  for (from = 0; from + SAMPLES_PER_SEC*60 < len; from += SAMPLES_PER_SEC) {
+    i = from + SAMPLES_PER_SEC + SAMPLES_PER_SEC*60;
+    find_frame_from(from, i < len ? i : len, &idx, &val);
+  }
+  if (idx != ref->frame_idx || val != ref->min_val*one)
+    check_fail(n, kind, e, "find_frame_from()");
+
+  stats->mismatches += check_failures - fails;
+  return check_failures - fails;
+}
+
+/* Check every engine on the buffer in bits[], the first len samples searched */
+
+static void check_buffer(uint32_t len, uint32_t n, const char *kind, check_stats_t *stats)
+{
+  check_result_t ref;
+  uint8_t saved[BLEN];
+  uint32_t i;
+
+  engine = &xor_engine;
+  engine_invalidate(0);
+  ref.frame_idx = check_ref_find(len, &ref.min_val);
+  check_decode(&ref);
+
+  memcpy(saved, bits, BLEN);
+  for (i = 0; engine_nth(i) != NULL; i++) {
+    if (engine_nth(i) == &llr_engine && llr_loaded) continue;
+    check_engine(engine_nth(i), &ref, len, n, kind, &stats[i]);
+    if (memcmp(saved, bits, BLEN) != 0) {
+      check_fail(n, kind, engine_nth(i), "sample buffer");
+      memcpy(bits, saved, BLEN);
+    }
+  }
+}
+
+/* Fill bits[] with a generated buffer of the given kind */
+
+void check_generate(uint32_t kind)
+{
+  uint8_t secs[60], pattern[SAMPLES_PER_SEC];
+  uint32_t i, offset, noise, ms, level, sec;
+  int32_t minute, cur;
+
+  switch (kind) {
+  case CHECK_RANDOM:
+    /* Mostly even odds, sometimes biased towards one level */
+    noise = rand() % 4 == 0 ? rand() % 100 : 50;
+    for (i = 0; i < BLEN; i++) bits[i] = (uint32_t)(rand() % 100) < noise;
+    break;
+  case CHECK_FRAME:
+    /* Two minutes of frames from a random minute and phase, as sampled */
+    minute = rand() % (100*366*1440);
+    offset = rand() % (60*SAMPLES_PER_SEC);
+    noise = rand() % 40;
+    cur = -1;
+    for (i = 0; i < BLEN; i++) {
+      sec = (i + offset)/SAMPLES_PER_SEC;
+      if (minute + (int32_t)(sec/60) != cur) encode_frame(cur = minute + sec/60, 0, 0, secs);
+      ms = (i + offset) % SAMPLES_PER_SEC*SAMP_PERIOD;
+      level = ms >= (secs[sec % 60] == 0 ? 200 : secs[sec % 60] == 1 ? 500 : 800);
+      if ((uint32_t)(rand() % 100) < noise) level ^= 1;
+      bits[i] = level;
+    }
+    break;
+  default:
+    /* A constant level, or one random second repeated */
+    if (rand() % 2) {
+      memset(bits, rand() % 2, BLEN);
+    } else {
+      for (i = 0; i < SAMPLES_PER_SEC; i++) pattern[i] = rand() % 2;
+      for (i = 0; i < BLEN; i++) bits[i] = pattern[i % SAMPLES_PER_SEC];
+    }
+    break;
+  }
+  engine_invalidate(0);
+}
+
+/* Check every engine against the reference on the sample files fnames and
+ * count generated buffers.  Returns -1 on any mismatch. */
+
+int check_run(char **fnames, uint32_t nfiles, uint32_t count)
+{
+  check_stats_t stats[16];
+  engine_t *saved = engine;
+  uint32_t i, n, kind, seed, buffers = 0;
+  uint64_t xor_usec = 0;
+
+  memset(stats, 0, sizeof(stats));
+  check_failures = 0;
+  seed = time(NULL);
+  srand(seed);
+
+  printf("Engine check, %u files and %u generated buffers, seed %u\n", nfiles, count, seed);
+  if (llr_loaded) printf("  llr skipped, its table makes it differ from xor\n");
+
+  for (n = 0; n < nfiles; n++) {
+    fill_buffer_file(fnames[n]);
+    check_buffer(BLEN, n, "file", stats);
+    buffers++;
+  }
+
+  for (n = 0; n < count && !wwvb_stop; n++) {
+    kind = n % CHECK_KINDS;
+    check_generate(kind);
+    /* Mostly whole buffers, sometimes short as in a capture */
+    check_buffer(rand() % 4 ? BLEN : 60*SAMPLES_PER_SEC + 1 + rand() % (BLEN - 60*SAMPLES_PER_SEC),
+		 n, check_kind_name[kind], stats);
+    buffers++;
+    if ((n + 1) % 10000 == 0) {
+      printf("  %u buffers, %u mismatches\n", n + 1, check_failures);
+      fflush(stdout);
+    }
+  }
+
+  for (i = 0; engine_nth(i) != NULL; i++)
+    if (engine_nth(i) == &xor_engine) xor_usec = stats[i].usec;
+
+  printf("  %-10s %14s %8s %11s\n", "engine", "usec/decode", "speedup", "mismatches");
+  for (i = 0; engine_nth(i) != NULL && buffers > 0; i++)
+    if (engine_nth(i) != &llr_engine || !llr_loaded)
+      printf("  %-10s %14.1f %7.2fx %11u\n", engine_nth(i)->name, stats[i].usec/(double)buffers,
+	     stats[i].usec > 0 ? xor_usec/(double)stats[i].usec : 0.0, stats[i].mismatches);
+  printf("  Check %s\n", check_failures == 0 ? "passed" : "FAILED");
+
+  engine = saved;
+  return check_failures == 0 ? 0 : -1;
+}
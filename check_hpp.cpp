@@ -0,0 +1,105 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Differential check of the header-only C++ decoder, wwvb_dec.hpp, against
+ * the C decoder it copies.  Linked with the C sources built without main().
+ * For the sample files given and count buffers from the -K generator, the
+ * frame start and search score from Decoder<>::find_frame() must be those of
+ * find_frame() on the xor engine, and the value, score and worst second of
+ * every field and the minute those of decode_frame() and frame_minute().
+ * Short buffers are searched as in a capture.  A buffer that fails is saved
+ * as check_hpp_fail_N.bin for -i.
+ *
+ *   check_hpp count [filename...]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <span>
+
+#include "wwvb_dec.hpp"
+
+extern "C" {
+#include "wwvb_dec.h"
+}
+
+using Dec = wwvb::Decoder<SAMP_PERIOD>;
+
+static uint32_t failures;
+
+static void fail(uint32_t n, const char *kind, const char *what)
+{
+  char fname[64];
+
+  if (failures < 10) {
+    snprintf(fname, sizeof(fname), "check_hpp_fail_%u.bin", failures);
+    save_buffer_file(fname);
+    fprintf(stderr, "Error: %s buffer %u: %s differs, saved as %s\n", kind, n, what, fname);
+  }
+  failures++;
+}
+
+/* Decode the first len samples of bits[] both ways and compare */
+
+static void check(uint32_t len, uint32_t n, const char *kind)
+{
+  std::span<const uint8_t> s(bits, len);
+  uint32_t frame_idx, min_val, score, i;
+
+  engine = &xor_engine;
+  engine_invalidate(0);
+  frame_idx = find_frame(len, &min_val);
+  score = decode_frame(frame_idx);
+
+  auto f = Dec::find_frame(s);
+  if (!f || f->frame_idx != frame_idx || f->min_val != min_val) {
+    fail(n, kind, "find_frame()");
+    return;
+  }
+  auto d = Dec::decode_frame(s, *f);
+  if (!d || d->score != score) {
+    fail(n, kind, "decode score");
+    return;
+  }
+  for (i = 0; i < NUM_FIELDS; i++) {
+    if (d->fields[i].value != frame[i].value || d->fields[i].score != frame[i].score ||
+	d->fields[i].worst_score != frame[i].worst_score) {
+      fail(n, kind, frame[i].name);
+      return;
+    }
+  }
+  if (d->minute() != frame_minute()) fail(n, kind, "minute");
+}
+
+int main(int argc, char *argv[])
+{
+  uint32_t n, count, seed, buffers = 0;
+  int i;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: check_hpp count [filename...]\n");
+    return EXIT_FAILURE;
+  }
+  count = atoi(argv[1]);
+  seed = time(NULL);
+  srand(seed);
+  printf("Header decoder check, %d files and %u generated buffers, seed %u\n", argc - 2, count, seed);
+
+  for (i = 2; i < argc; i++) {
+    fill_buffer_file(argv[i]);
+    check(BLEN, i - 2, "file");
+    buffers++;
+  }
+
+  for (n = 0; n < count; n++) {
+    check_generate(n % CHECK_KINDS);
+    check(rand() % 4 ? BLEN : 60*SAMPLES_PER_SEC + 1 + rand() % (BLEN - 60*SAMPLES_PER_SEC), n, "generated");
+    buffers++;
+  }
+
+  printf("  %u buffers, %u mismatches\n", buffers, failures);
+  printf("  Check %s\n", failures == 0 ? "passed" : "FAILED");
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
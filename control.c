@@ -0,0 +1,461 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Control socket.  With -C or -L, option -S path listens on a Unix domain
+ * socket for requests, one per line, each answered with lines of text ending
+ * with a line holding only ".":
+ *
+ *   status          lock state, latest decode, and flywheel time now
+ *   decodes [n]     the last n decodes (all kept if no n), oldest first:
+ *                   minute of the run, frame_idx, search score, decode score,
+ *                   worst second, and the time decoded or "-"
+ *   jitter          how late the sampler read samples, per minute
+ *   reacquire       forget the lock, the flywheel restarts from the next
+ *                   confident decode
+ *   dump name       write the samples of the latest decode, as -o, to file
+ *                   name in the directory of the socket
+ *   help            this list
+ *
+ * The decoder publishes a snapshot after every decode under a sequence lock,
+ * and requests are answered from a copy of it, so a client never holds up
+ * the decoder, let alone the sampler.  The only way back is the reacquire
+ * flag, which the decoder takes at its next decode.
+ *
+ * The listening socket and the clients are registered with an epoll set,
+ * and control_event() answers whatever is ready on one of them.  With -C
+ * the set is the control thread's own, started by control_start(); with -L
+ * it is the event loop's, given by control_epoll(), and no thread is used.
+ * Only one read of a client is made per event, so a slow client can not hold
+ * up the loop.
+ *
+ *   echo status | socat - UNIX-CONNECT:/run/wwvb.sock
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "wwvb_dec.h"
+
+/* Decodes kept for "decodes" */
+#define CONTROL_HIST 64
+
+#define CONTROL_CLIENTS 8
+#define CONTROL_LINE 256
+
+typedef struct {
+  uint32_t seq;           /* minute of the run */
+  uint32_t frame_idx, min_val, score, worst;
+  int32_t minute;         /* -1 if not a valid time */
+} control_rec_t;
+
+typedef struct {
+  char *state;            /* "acquiring", "locked", or "holdover" */
+  uint32_t n;             /* decodes so far */
+  uint32_t good;          /* confident decodes since the lock was taken */
+  uint64_t good_local;    /* source time of the last confident frame */
+  control_rec_t recs[CONTROL_HIST];
+  uint32_t late_last, late_max;   /* latest sample, usec */
+  uint64_t late_sum;              /* of each minute's latest */
+  uint32_t missed;
+  uint8_t bits[BLEN];
+} control_snap_t;
+
+/* Published by the decode thread */
+static _Atomic uint32_t control_seq;
+static control_snap_t control;
+
+static _Atomic int control_reacquire_flag;
+static int control_fd = -1;
+static char *control_path;
+static char control_dir[CONTROL_LINE];
+static source_t *control_src;
+static uint32_t control_hold;   /* decoder's copy of control.good */
+
+/* Clients, fd -1 if the slot is free */
+static struct {
+  int fd;
+  uint32_t len;
+  char buf[CONTROL_LINE];
+} control_clients[CONTROL_CLIENTS];
+
+static int control_epfd = -1;   /* the epoll set the fds are in */
+static int control_own_epfd;    /* it is the control thread's */
+static int control_wake_fd = -1;
+static pthread_t control_thread;
+static int control_thread_running;
+
+/* Take a consistent copy of the snapshot */
+
+static void control_read(control_snap_t *snap)
+{
+  uint32_t seq;
+
+  do {
+    while ((seq = atomic_load_explicit(&control_seq, memory_order_acquire)) & 1) {}
+    memcpy(snap, &control, sizeof(control));
+    atomic_thread_fence(memory_order_acquire);
+  } while (atomic_load_explicit(&control_seq, memory_order_relaxed) != seq);
+}
+
+/* Publish the decode of the frame at frame_idx in bits[], just decoded, as
+ * minute seq of the run.  late_max is the latest a sample of the minute was
+ * read and missed the samples lost, both from the sampler. */
+
+void control_decode(uint32_t seq, uint64_t local, uint32_t frame_idx, uint32_t min_val,
+		    uint32_t score, uint32_t late_max, uint32_t missed)
+{
+  control_rec_t *r;
+  uint32_t worst = frame_worst_score();
+  int32_t minute = frame_minute();
+  uint64_t utc, unc;
+
+  if (control_fd < 0) return;
+
+  if (atomic_exchange(&control_reacquire_flag, 0)) {
+    flywheel_reset();
+    control_hold = 0;
+    printf("  Control: lock dropped, reacquiring\n");
+  }
+
+  atomic_fetch_add_explicit(&control_seq, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  r = &control.recs[control.n % CONTROL_HIST];
+  r->seq = seq;
+  r->frame_idx = frame_idx;
+  r->min_val = score_errors(min_val);
+  r->score = score_errors(score);
+  r->worst = score_errors(worst);
+  r->minute = minute;
+  control.n++;
+
+  if (worst < verdict_ok*engine->one && minute >= 0) {
+    control_hold++;
+    control.good_local = local;
+    control.state = "locked";
+  } else {
+    control.state = control_hold > 0 && flywheel_now(local, &utc, &unc) ? "holdover" : "acquiring";
+  }
+  control.good = control_hold;
+
+  control.late_last = late_max;
+  if (late_max > control.late_max) control.late_max = late_max;
+  control.late_sum += late_max;
+  control.missed += missed;
+  memcpy(control.bits, bits, BLEN);
+
+  atomic_thread_fence(memory_order_release);
+  atomic_fetch_add_explicit(&control_seq, 1, memory_order_relaxed);
+}
+
+static void control_print_minute(FILE *fp, int32_t minute)
+{
+  uint32_t year, daynum, hours, minutes, lyi;
+
+  if (minute < 0) {
+    fprintf(fp, "-");
+    return;
+  }
+  minute_to_fields(minute, &year, &daynum, &hours, &minutes, &lyi);
+  fprintf(fp, "%02u/%03u %02u:%02u", year, daynum, hours, minutes);
+}
+
+/* Answer one request to fp */
+
+static void control_request(char *line, FILE *fp)
+{
+  static control_snap_t snap;
+  char cmd[32], arg[CONTROL_LINE], fname[2*CONTROL_LINE];
+  uint32_t i, n, first;
+  uint64_t now, utc, unc;
+  control_rec_t *r;
+  FILE *out;
+
+  arg[0] = '\0';
+  if (sscanf(line, "%31s %255s", cmd, arg) < 1) return;
+  control_read(&snap);
+
+  if (strcmp(cmd, "status") == 0) {
+    fprintf(fp, "state %s\n", snap.state != NULL ? snap.state : "acquiring");
+    fprintf(fp, "decodes %u\n", snap.n);
+    fprintf(fp, "confident %u\n", snap.good);
+    if (snap.n > 0) {
+      r = &snap.recs[(snap.n - 1) % CONTROL_HIST];
+      fprintf(fp, "last minute %u worst %u time ", r->seq, r->worst);
+      control_print_minute(fp, r->minute);
+      fprintf(fp, "\n");
+    }
+    now = control_src->now();
+    if (snap.good > 0) fprintf(fp, "since_confident %.1f s\n", (now - snap.good_local)/1e6);
+    if (flywheel_now(now, &utc, &unc))
+      fprintf(fp, "flywheel %llu.%06u +/- %.1f ms\n", (unsigned long long)(utc/1000000),
+	      (uint32_t)(utc % 1000000), unc/1000.0);
+  } else if (strcmp(cmd, "decodes") == 0) {
+    n = arg[0] != '\0' ? (uint32_t)atoi(arg) : CONTROL_HIST;
+    if (n > CONTROL_HIST) n = CONTROL_HIST;
+    if (n > snap.n) n = snap.n;
+    first = snap.n - n;
+    fprintf(fp, "# minute frame_idx min_val score worst time\n");
+    for (i = first; i < snap.n; i++) {
+      r = &snap.recs[i % CONTROL_HIST];
+      fprintf(fp, "%u %u %u %u %u ", r->seq, r->frame_idx, r->min_val, r->score, r->worst);
+      control_print_minute(fp, r->minute);
+      fprintf(fp, "\n");
+    }
+  } else if (strcmp(cmd, "jitter") == 0) {
+    fprintf(fp, "minutes %u\n", snap.n);
+    fprintf(fp, "late_last %u usec\n", snap.late_last);
+    fprintf(fp, "late_max %u usec\n", snap.late_max);
+    fprintf(fp, "late_mean %u usec\n", snap.n ? (uint32_t)(snap.late_sum/snap.n) : 0);
+    fprintf(fp, "missed %u\n", snap.missed);
+  } else if (strcmp(cmd, "reacquire") == 0) {
+    atomic_store(&control_reacquire_flag, 1);
+    fprintf(fp, "ok, at the next decode\n");
+  } else if (strcmp(cmd, "dump") == 0) {
+    /* Only to a plain name beside the socket */
+    if (arg[0] == '\0' || arg[0] == '.' || strchr(arg, '/') != NULL) {
+      fprintf(fp, "error: dump needs a file name without a directory\n");
+    } else if (snap.n == 0) {
+      fprintf(fp, "error: no decode yet\n");
+    } else if (snprintf(fname, sizeof(fname), "%s%s%s", control_dir,
+			control_dir[strlen(control_dir) - 1] == '/' ? "" : "/", arg) >= (int)sizeof(fname) ||
+	       (out = fopen(fname, "wb")) == NULL) {
+      fprintf(fp, "error: could not open file %s for writing\n", fname);
+    } else {
+      fwrite(snap.bits, 1, BLEN, out);
+      fclose(out);
+      fprintf(fp, "ok %u samples\n", BLEN);
+    }
+  } else if (strcmp(cmd, "help") == 0) {
+    fprintf(fp, "status\ndecodes [n]\njitter\nreacquire\ndump name\nhelp\n");
+  } else {
+    fprintf(fp, "error: unknown request %s, try help\n", cmd);
+  }
+  fprintf(fp, ".\n");
+}
+
+/* Answer the complete lines in client c's buffer, keeping any partial line.
+ * Returns -1 if the client should be dropped. */
+
+static int control_client(uint32_t c)
+{
+  char reply[8192], *nl, *buf = control_clients[c].buf, *start = buf;
+  uint32_t *len = &control_clients[c].len;
+  int fd = control_clients[c].fd;
+  FILE *fp;
+  size_t n;
+  ssize_t r;
+
+  r = read(fd, buf + *len, CONTROL_LINE - 1 - *len);
+  if (r <= 0) return -1;
+  *len += r;
+  buf[*len] = '\0';
+
+  while ((nl = strchr(start, '\n')) != NULL) {
+    *nl = '\0';
+    if ((fp = fmemopen(reply, sizeof(reply), "w")) == NULL) return -1;
+    control_request(start, fp);
+    n = ftell(fp);
+    fclose(fp);
+    /* A client that stops reading is dropped rather than waited for */
+    if (send(fd, reply, n, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)n) return -1;
+    start = nl + 1;
+  }
+
+  *len -= start - buf;
+  memmove(buf, start, *len);
+  return *len < CONTROL_LINE - 1 ? 0 : -1;
+}
+
+static void control_drop(uint32_t c)
+{
+  epoll_ctl(control_epfd, EPOLL_CTL_DEL, control_clients[c].fd, NULL);
+  close(control_clients[c].fd);
+  control_clients[c].fd = -1;
+}
+
+static void control_accept(void)
+{
+  struct epoll_event ev;
+  uint32_t c;
+  int fd;
+
+  if ((fd = accept(control_fd, NULL, NULL)) < 0) return;
+  for (c = 0; c < CONTROL_CLIENTS && control_clients[c].fd >= 0; c++)
+    ;
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (c == CONTROL_CLIENTS || epoll_ctl(control_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    close(fd);
+    return;
+  }
+  control_clients[c].fd = fd;
+  control_clients[c].len = 0;
+}
+
+/* Answer what is ready on fd, from the epoll set.  Returns 1 if fd is the
+ * control socket's or a client's, 0 if it is not ours. */
+
+int control_event(int fd)
+{
+  uint32_t c;
+
+  if (control_fd < 0) return 0;
+  if (fd == control_fd) {
+    control_accept();
+    return 1;
+  }
+  for (c = 0; c < CONTROL_CLIENTS; c++) {
+    if (control_clients[c].fd != fd) continue;
+    if (control_client(c) < 0) control_drop(c);
+    return 1;
+  }
+  return 0;
+}
+
+/* Register the control socket with the epoll set epfd, whose owner passes
+ * its events to control_event() */
+
+int control_epoll(int epfd)
+{
+  struct epoll_event ev;
+
+  if (control_fd < 0) return 0;
+  ev.events = EPOLLIN;
+  ev.data.fd = control_fd;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, control_fd, &ev) < 0) {
+    perror("Error: epoll_ctl control socket");
+    return -1;
+  }
+  control_epfd = epfd;
+  return 0;
+}
+
+static void *control_serve(void *arg)
+{
+  struct epoll_event events[1 + CONTROL_CLIENTS];
+  int i, n;
+
+  trace_thread_name("control");
+
+  for (;;) {
+    if ((n = epoll_wait(control_epfd, events, 1 + CONTROL_CLIENTS, -1)) < 0) continue;
+    for (i = 0; i < n; i++) {
+      if (events[i].data.fd == control_wake_fd) return NULL;
+      control_event(events[i].data.fd);
+    }
+  }
+}
+
+/* Serve the control socket on a thread of its own, for -C */
+
+int control_start(void)
+{
+  struct epoll_event ev;
+
+  if (control_fd < 0) return 0;
+  if ((control_epfd = epoll_create1(0)) < 0 || (control_wake_fd = eventfd(0, 0)) < 0) {
+    perror("Error: control epoll");
+    return -1;
+  }
+  control_own_epfd = 1;
+  ev.events = EPOLLIN;
+  ev.data.fd = control_wake_fd;
+  if (epoll_ctl(control_epfd, EPOLL_CTL_ADD, control_wake_fd, &ev) < 0 || control_epoll(control_epfd) < 0) {
+    perror("Error: epoll_ctl control");
+    return -1;
+  }
+  if (pthread_create(&control_thread, NULL, control_serve, NULL) != 0) {
+    fprintf(stderr, "Error: could not start control thread\n");
+    return -1;
+  }
+  control_thread_running = 1;
+  return 0;
+}
+
+/* Listen on a Unix domain socket at path, for source src.  Requests are not
+ * answered until control_start() or control_epoll(). */
+
+int control_open(char *path, source_t *src)
+{
+  struct sockaddr_un addr;
+  char *slash;
+  uint32_t c;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Error: control socket path %s too long\n", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  if ((control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+    perror("Error: control socket");
+    return -1;
+  }
+  unlink(path);
+  if (bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(control_fd, 4) < 0) {
+    fprintf(stderr, "Error: could not listen on control socket %s\n", path);
+    close(control_fd);
+    control_fd = -1;
+    return -1;
+  }
+  /* Only the owner may dump buffers to files */
+  chmod(path, 0600);
+
+  /* Dumps go beside the socket */
+  if ((slash = strrchr(path, '/')) == NULL) {
+    strcpy(control_dir, ".");
+  } else if (slash == path) {
+    strcpy(control_dir, "/");
+  } else {
+    memcpy(control_dir, path, slash - path);
+    control_dir[slash - path] = '\0';
+  }
+
+  for (c = 0; c < CONTROL_CLIENTS; c++) control_clients[c].fd = -1;
+  control_path = path;
+  control_src = src;
+  return 0;
+}
+
+/* Stop serving, close the socket and its clients, and remove it */
+
+void control_close(void)
+{
+  uint64_t one = 1;
+  uint32_t c;
+
+  if (control_fd < 0) return;
+
+  if (control_thread_running) {
+    if (write(control_wake_fd, &one, sizeof(one)) == sizeof(one)) pthread_join(control_thread, NULL);
+    control_thread_running = 0;
+  }
+  for (c = 0; c < CONTROL_CLIENTS; c++) {
+    if (control_clients[c].fd < 0) continue;
+    close(control_clients[c].fd);
+    control_clients[c].fd = -1;
+  }
+  if (control_own_epfd) close(control_epfd);
+  if (control_wake_fd >= 0) close(control_wake_fd);
+  control_epfd = control_wake_fd = -1;
+  control_own_epfd = 0;
+
+  close(control_fd);
+  control_fd = -1;
+  unlink(control_path);
+  control_path = NULL;
+}
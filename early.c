@@ -0,0 +1,91 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Progressive early decode.  When the start of the frame is known before it
+ * is captured, as it is once the scheduler is locked, each field is decoded
+ * and printed as soon as its last second has been sampled: minutes at second
+ * 8, hours at second 18, and so on, with the verdict on the whole frame at
+ * second 59.  A consumer that only needs the time of day has it well before
+ * the capture ends.
+ *
+ * The scheduler (-d) and the event loop (-L) predict the frame start, the
+ * event loop a minute after each confident decode.  -C does not, its decoder
+ * has each minute of samples only once the minute is over.
+ */
+
+#include <stdio.h>
+
+#include "wwvb_dec.h"
+
+int early_enabled;
+
+static int32_t early_frame_idx = -1;
+static uint32_t early_last_sec[NUM_FIELDS];
+static uint32_t early_done;      /* seconds of the frame decoded */
+static uint32_t early_worst;
+static int early_failed;
+
+/* Start early decode of a capture whose frame is expected to start at sample
+ * frame_idx, or -1 if not known, in which case nothing is done */
+
+void early_start(int32_t frame_idx)
+{
+  uint32_t i, j;
+
+  early_frame_idx = frame_idx;
+  early_done = 0;
+  early_worst = 0;
+  early_failed = 0;
+
+  for (i = 0; i < NUM_FIELDS; i++) {
+    early_last_sec[i] = 0;
+    for (j = 0; j < frame[i].code_len; j++)
+      if (frame[i].code[j].bit > early_last_sec[i]) early_last_sec[i] = frame[i].code[j].bit;
+  }
+}
+
+/* Called as each sample i arrives.  Decodes the fields whose last second has
+ * been completed since the last call, which may be several if the start of the
+ * capture was carried over from the last one. */
+
+void early_sample(uint32_t i)
+{
+  uint32_t f, s, sec, val, score, worst;
+
+  if (early_frame_idx < 0 || i + 1 < (uint32_t)early_frame_idx) return;
+
+  /* Seconds of the frame complete */
+  sec = (i + 1 - early_frame_idx)/SAMPLES_PER_SEC;
+  if (sec > 60) sec = 60;
+  if (sec <= early_done) return;
+
+  TRACE_BEGIN("early_sample");
+  for (s = early_done; s < sec; s++) {
+    for (f = 0; f < NUM_FIELDS; f++) {
+      if (early_last_sec[f] != s) continue;
+      val = decode_field(early_frame_idx, frame[f].code, frame[f].code_len, &score, &worst);
+      if (score == DECODE_FAILURE*engine->one) {
+	early_failed = 1;
+	printf("  Early %02u s: %s failed\n", s, frame[f].name);
+      } else {
+	printf("  Early %02u s: %s %u (%u/%.2f-%02u)\n", s, frame[f].name, val, score_errors(score),
+	       score/(float)(frame[f].code_len*engine->one), score_errors(worst));
+      }
+      if (worst > early_worst) early_worst = worst;
+    }
+  }
+
+  if (sec == 60) {
+    printf("  Early 59 s: frame complete - %02u ", score_errors(early_worst));
+    if (!early_failed && early_worst < verdict_ok*engine->one)
+      printf("LIKELY OK\n");
+    else if (!early_failed && early_worst < VERDICT_UNRELIABLE*engine->one)
+      printf("NOT RELIABLE\n");
+    else
+      printf("PROBABLY BAD\n");
+  }
+  early_done = sec;
+  fflush(stdout);
+  TRACE_END("early_sample");
+}
@@ -0,0 +1,258 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Edge event logs.  Rather than samples, a log holds the time of every change
+ * of the receiver output, to the microsecond.  A clean second has just two
+ * edges, and each is stored as a varint of the time since the previous edge,
+ * shifted left one with the new level in bit 0, so a day is a few hundred KB.
+ *
+ *   "WWVBEDG1"                      8 byte magic
+ *   varint                          wall clock at time 0, usec since the epoch
+ *   varint (delta_usec << 1 | level) per edge
+ *
+ * Varints are little endian base 128, high bit set on all but the last byte.
+ *
+ * Logs are written by backends as edges happen: the GPIO backend from a
+ * pigpio alert, timed by pigpio to the microsecond, and the simulator at its
+ * sample times.  A log given to -i is replayed as a sample source on a virtual
+ * clock, so it can be decoded in any mode, as if live.  Replay samples at the
+ * SAMP_PERIOD the decoder is built with, like a live receiver.  When the log
+ * runs out replay sets wwvb_stop, and edgelog_replay_ended.
+ *
+ * edgelog_export() converts a whole log to a sample file, one byte per sample
+ * as -o writes, at any sample period, for other tools or another build.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wwvb_dec.h"
+
+#define EDGELOG_MAGIC "WWVBEDG1"
+#define EDGELOG_MAGIC_LEN 8
+
+/* Replay ends this long after the last edge, usec */
+#define EDGELOG_TAIL_USEC 2000000
+
+int edgelog_enabled;
+
+static FILE *edgelog_fp;
+static int edgelog_started;
+static uint64_t edgelog_origin, edgelog_last;
+
+static void put_varint(FILE *fp, uint64_t v)
+{
+  while (v >= 0x80) {
+    putc((v & 0x7f) | 0x80, fp);
+    v >>= 7;
+  }
+  putc(v, fp);
+}
+
+/* Returns 0 at end of file */
+
+static int get_varint(FILE *fp, uint64_t *v)
+{
+  int c, shift = 0;
+
+  *v = 0;
+  do {
+    if ((c = getc(fp)) == EOF || shift > 63) return 0;
+    *v |= (uint64_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+
+  return 1;
+}
+
+/* Create a log.  Sources check edgelog_enabled when opened to start
+ * reporting edges, which are logged from edgelog_start(). */
+
+int edgelog_open(char *fname)
+{
+  if ((edgelog_fp = fopen(fname, "wb")) == NULL) {
+    fprintf(stderr, "Error: could not open file %s for writing\n", fname);
+    return -1;
+  }
+  edgelog_enabled = 1;
+
+  return 0;
+}
+
+/* Start logging, with time 0 now on the clock of the open source src */
+
+void edgelog_start(source_t *src)
+{
+  if (!edgelog_enabled) return;
+
+  edgelog_origin = src->now();
+  fwrite(EDGELOG_MAGIC, 1, EDGELOG_MAGIC_LEN, edgelog_fp);
+  put_varint(edgelog_fp, src->realtime());
+  edgelog_last = 0;
+  edgelog_started = 1;
+}
+
+/* Add an edge to level at source time usec.  Edges must come in order, and
+ * only from one thread. */
+
+void edgelog_edge(uint64_t usec, uint32_t level)
+{
+  if (!edgelog_started) return;
+
+  usec = usec > edgelog_origin ? usec - edgelog_origin : 0;
+  if (usec < edgelog_last) usec = edgelog_last;
+  put_varint(edgelog_fp, (usec - edgelog_last) << 1 | (level & 1));
+  edgelog_last = usec;
+}
+
+void edgelog_close(void)
+{
+  if (!edgelog_enabled) return;
+  edgelog_enabled = 0;
+  edgelog_started = 0;
+  if (fclose(edgelog_fp) != 0) fprintf(stderr, "Warning: error writing edge log\n");
+}
+
+/* Whether fname is an edge log */
+
+int edgelog_detect(char *fname)
+{
+  FILE *fp;
+  char magic[EDGELOG_MAGIC_LEN];
+  int found;
+
+  if ((fp = fopen(fname, "rb")) == NULL) return 0;
+  found = fread(magic, 1, EDGELOG_MAGIC_LEN, fp) == EDGELOG_MAGIC_LEN &&
+    memcmp(magic, EDGELOG_MAGIC, EDGELOG_MAGIC_LEN) == 0;
+  fclose(fp);
+
+  return found;
+}
+
+/* Replay of a log as a sample source.  The level is that of the last edge at
+ * or before the virtual time, with the next edge read ahead. */
+
+char *edgelog_replay_fname;
+int edgelog_replay_ended;
+
+static FILE *replay_fp;
+static uint64_t replay_time, replay_realtime, replay_next;
+static uint32_t replay_level, replay_next_level;
+static int replay_eof;
+
+static void replay_advance(void)
+{
+  uint64_t v;
+
+  while (!replay_eof && replay_next <= replay_time) {
+    replay_level = replay_next_level;
+    if (get_varint(replay_fp, &v)) {
+      replay_next += v >> 1;
+      replay_next_level = v & 1;
+    } else {
+      replay_eof = 1;
+    }
+  }
+  if (replay_eof && replay_time > replay_next + EDGELOG_TAIL_USEC) {
+    edgelog_replay_ended = 1;
+    wwvb_stop = 1;
+  }
+}
+
+static int replay_open(void)
+{
+  char magic[EDGELOG_MAGIC_LEN];
+
+  if ((replay_fp = fopen(edgelog_replay_fname, "rb")) == NULL) {
+    fprintf(stderr, "Error: could not open file %s for reading\n", edgelog_replay_fname);
+    return -1;
+  }
+  if (fread(magic, 1, EDGELOG_MAGIC_LEN, replay_fp) != EDGELOG_MAGIC_LEN ||
+      memcmp(magic, EDGELOG_MAGIC, EDGELOG_MAGIC_LEN) != 0 ||
+      !get_varint(replay_fp, &replay_realtime)) {
+    fprintf(stderr, "Error: %s is not an edge log\n", edgelog_replay_fname);
+    fclose(replay_fp);
+    return -1;
+  }
+
+  replay_time = 0;
+  replay_next = 0;
+  replay_level = 0;
+  replay_next_level = 0;
+  replay_eof = 0;
+  replay_advance();
+
+  return 0;
+}
+
+static void replay_close(void)
+{
+  fclose(replay_fp);
+}
+
+static uint64_t replay_now(void)
+{
+  return replay_time;
+}
+
+static uint64_t replay_realtime_now(void)
+{
+  return replay_realtime + replay_time;
+}
+
+static void replay_wait_until(uint64_t usec)
+{
+  if (usec > replay_time) replay_time = usec;
+}
+
+static void replay_sleep(uint64_t usec)
+{
+  replay_time += usec;
+}
+
+static uint32_t replay_read(void)
+{
+  replay_advance();
+  return replay_level;
+}
+
+static void replay_power(int on)
+{
+}
+
+/* Write the log fname as a sample file outname, sampled every period_usec
+ * from time 0 to the end of the log */
+
+int edgelog_export(char *fname, char *outname, uint32_t period_usec)
+{
+  FILE *fp;
+  uint64_t n = 0;
+
+  edgelog_replay_fname = fname;
+  if (replay_open() < 0) return -1;
+  if ((fp = fopen(outname, "wb")) == NULL) {
+    fprintf(stderr, "Error: could not open file %s for writing\n", outname);
+    replay_close();
+    return -1;
+  }
+
+  while (!replay_eof || replay_time <= replay_next + EDGELOG_TAIL_USEC) {
+    replay_time = n*period_usec;
+    replay_read();
+    putc(replay_level, fp);
+    n++;
+  }
+
+  replay_close();
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "Error: error writing %s\n", outname);
+    return -1;
+  }
+  printf("%llu samples of %u usec written to %s\n", (unsigned long long)n, period_usec, outname);
+  return 0;
+}
+
+source_t edgelog_source = {"edgelog", replay_open, replay_close, replay_now, replay_realtime_now,
+			   replay_wait_until, replay_sleep, replay_read, replay_power};
@@ -0,0 +1,320 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Symbol scoring engines.  Both the frame search and field decoding come down
+ * to scoring one second of samples against the ideal 0, 1, and marker, and the
+ * same seconds are scored over and over: every candidate frame start scores
+ * 18 seconds, and the candidates one second apart share 17 of them.  An engine
+ * provides those scores:
+ *
+ *   xor    the original byte by byte loop, xor_sec(), computed on every call.
+ *   cache  every second's scores against all three symbols, for every start
+ *          sample in the buffer, computed once from a prefix sum of the
+ *          samples and then read by index.
+ *   bitslice  the same table, computed from a transposed copy of the
+ *          samples.  For each phase (start sample within a second) and each
+ *          sample position within the second, the samples of up to a machine
+ *          word's worth of consecutive seconds are packed into one word, so
+ *          the errors of 32 or 64 seconds are counted at once with bitwise
+ *          ops and bit-sliced adders.  Needs no SIMD or popcount, which suits
+ *          the ARMv6 of the Pi Zero.
+ *   lut    computed on every call like xor, but from a packed copy of the
+ *          samples, 8 to a byte.  A table gives the errors of each 8 sample
+ *          pattern at each of the 5 positions in a second against each
+ *          symbol, so a second is scored with 5 lookups.  Also needs no SIMD
+ *          or popcount.
+ *   llr    log-likelihood of the samples for each symbol, from error rates by
+ *          position learned from a labeled corpus, see llr.c.
+ *
+ * Engines that keep a table track how much of bits[] it covers.  Anything that
+ * changes bits[] calls engine_invalidate() with the first sample changed, and
+ * the table is brought up to date when next used.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "wwvb_dec.h"
+
+/* Samples of reduced carrier (0) at the start of a 0, 1, and marker */
+static const uint32_t sym_low_len[3] = {200/SAMP_PERIOD, 500/SAMP_PERIOD, 800/SAMP_PERIOD};
+
+/* The byte by byte engine */
+
+static void xor_prepare(uint32_t len)
+{
+}
+
+static uint32_t xor_score(uint32_t samp_idx, uint32_t sym)
+{
+  return xor_sec(samp_idx, sym_low_len[sym], SAMPLES_PER_SEC - sym_low_len[sym]);
+}
+
+static void xor_invalidate(uint32_t from)
+{
+}
+
+engine_t xor_engine = {"xor", xor_prepare, xor_score, xor_invalidate, 1};
+
+/* The score cache.  cache_ones[i] is the count of ones in the first i samples,
+ * and cache_scores[sym][i] the score of the second starting at sample i.  Both
+ * are valid for windows within the first cache_len samples. */
+
+static uint16_t cache_ones[BLEN + 1];
+static uint8_t cache_scores[3][BLEN];
+static uint32_t cache_len;
+
+static void cache_prepare(uint32_t len)
+{
+  uint32_t i, sym, low, ones_low, ones_high;
+
+  if (len > BLEN) len = BLEN;
+  if (len <= cache_len) return;
+
+  TRACE_BEGIN("cache_prepare");
+  for (i = cache_len; i < len; i++) cache_ones[i + 1] = cache_ones[i] + bits[i];
+
+  /* Windows that ran past the old end were not valid */
+  i = cache_len >= SAMPLES_PER_SEC ? cache_len - SAMPLES_PER_SEC + 1 : 0;
+  for (; i + SAMPLES_PER_SEC <= len; i++) {
+    for (sym = 0; sym < 3; sym++) {
+      low = sym_low_len[sym];
+      ones_low = cache_ones[i + low] - cache_ones[i];
+      ones_high = cache_ones[i + SAMPLES_PER_SEC] - cache_ones[i + low];
+      cache_scores[sym][i] = ones_low + (SAMPLES_PER_SEC - low - ones_high);
+    }
+  }
+  cache_len = len;
+  TRACE_END("cache_prepare");
+}
+
+static uint32_t cache_score(uint32_t samp_idx, uint32_t sym)
+{
+  if (__builtin_expect(samp_idx + SAMPLES_PER_SEC > cache_len, 0))
+    cache_prepare(samp_idx + SAMPLES_PER_SEC);
+  return cache_scores[sym][samp_idx];
+}
+
+static void cache_invalidate(uint32_t from)
+{
+  if (from < cache_len) cache_len = from;
+}
+
+engine_t cache_engine = {"cache", cache_prepare, cache_score, cache_invalidate, 1};
+
+/* The bit-sliced engine.  Sample j of the second starting at sample p is the
+ * same sample as sample j - 1 of the second starting at p + 1, so the
+ * transposed samples are indexed by m = p + j: bit l of bs_x[w][m] is sample
+ * m + SAMPLES_PER_SEC*(w*BS_LANES + l). */
+
+typedef unsigned long bs_word_t;
+
+#define BS_LANES (8*sizeof(bs_word_t))
+#define BS_WORDS ((BUF_LEN_IN_SEC + BS_LANES - 1)/BS_LANES)
+#define BS_COUNT_BITS 6   /* enough to count to SAMPLES_PER_SEC */
+
+_Static_assert(SAMPLES_PER_SEC < (1 << BS_COUNT_BITS), "bit-sliced counters too narrow for SAMPLES_PER_SEC");
+
+static bs_word_t bs_x[BS_WORDS][2*SAMPLES_PER_SEC - 1];
+static uint8_t bs_scores[3][BLEN];
+static uint32_t bs_len;
+
+/* Add one bit per lane to bit-sliced counters c */
+
+static inline void bs_add(bs_word_t *c, bs_word_t m)
+{
+  bs_word_t carry;
+  uint32_t b;
+
+  for (b = 0; b < BS_COUNT_BITS && m; b++) {
+    carry = c[b] & m;
+    c[b] ^= m;
+    m = carry;
+  }
+}
+
+/* Score the seconds of word w starting at phase p, for the lanes whose
+ * seconds lie within the first len samples */
+
+static void bs_score_word(uint32_t w, uint32_t p, uint32_t len)
+{
+  bs_word_t c[BS_COUNT_BITS];
+  uint32_t j, l, b, sym, low, idx, lanes, score;
+
+  idx = p + SAMPLES_PER_SEC*w*BS_LANES;
+  if (idx + SAMPLES_PER_SEC > len) return;
+  lanes = (len - idx - SAMPLES_PER_SEC)/SAMPLES_PER_SEC + 1;
+  if (lanes > BS_LANES) lanes = BS_LANES;
+
+  for (sym = 0; sym < 3; sym++) {
+    memset(c, 0, sizeof(c));
+    low = sym_low_len[sym];
+    for (j = 0; j < low; j++) bs_add(c, bs_x[w][p + j]);
+    for (; j < SAMPLES_PER_SEC; j++) bs_add(c, ~bs_x[w][p + j]);
+
+    for (l = 0; l < lanes; l++) {
+      score = 0;
+      for (b = 0; b < BS_COUNT_BITS; b++) score |= ((c[b] >> l) & 1) << b;
+      bs_scores[sym][idx + l*SAMPLES_PER_SEC] = score;
+    }
+  }
+}
+
+static void bs_prepare(uint32_t len)
+{
+  uint32_t w, m, l, p, k, idx;
+  bs_word_t x;
+
+  if (len > BLEN) len = BLEN;
+  if (len <= bs_len) return;
+
+  TRACE_BEGIN("bitslice_prepare");
+
+  /* First word with a second not already scored at some phase */
+  k = bs_len >= 2*SAMPLES_PER_SEC - 1 ? (bs_len - 2*SAMPLES_PER_SEC + 1)/SAMPLES_PER_SEC + 1 : 0;
+
+  for (w = k/BS_LANES; w < BS_WORDS; w++) {
+    for (m = 0; m < 2*SAMPLES_PER_SEC - 1; m++) {
+      x = 0;
+      for (l = 0; l < BS_LANES; l++) {
+	idx = m + SAMPLES_PER_SEC*(w*BS_LANES + l);
+	if (idx >= len) break;
+	x |= (bs_word_t)bits[idx] << l;
+      }
+      bs_x[w][m] = x;
+    }
+    for (p = 0; p < SAMPLES_PER_SEC; p++) bs_score_word(w, p, len);
+  }
+
+  bs_len = len;
+  TRACE_END("bitslice_prepare");
+}
+
+static uint32_t bs_score(uint32_t samp_idx, uint32_t sym)
+{
+  if (__builtin_expect(samp_idx + SAMPLES_PER_SEC > bs_len, 0))
+    bs_prepare(samp_idx + SAMPLES_PER_SEC);
+  return bs_scores[sym][samp_idx];
+}
+
+static void bs_invalidate(uint32_t from)
+{
+  if (from < bs_len) bs_len = from;
+}
+
+engine_t bitslice_engine = {"bitslice", bs_prepare, bs_score, bs_invalidate, 1};
+
+/* The lookup table engine.  Bit k of lut_packed[b] is sample 8*b + k, valid for
+ * the first lut_len samples.  lut[sym][c][x] is the errors of pattern x as
+ * samples 8*c to 8*c + 7 of a second against symbol sym. */
+
+#define LUT_CHUNKS (SAMPLES_PER_SEC/8)
+
+/* Whole chunks only, a partial one would go unscored */
+_Static_assert(SAMPLES_PER_SEC % 8 == 0, "lut engine needs a multiple of 8 samples per second");
+
+static uint8_t lut_packed[BLEN/8 + 2];
+static uint8_t lut[3][LUT_CHUNKS][256];
+static uint32_t lut_len;
+static int lut_ready;
+
+static void lut_init(void)
+{
+  uint32_t sym, c, x, k, pos, expect;
+
+  for (sym = 0; sym < 3; sym++) {
+    for (c = 0; c < LUT_CHUNKS; c++) {
+      for (x = 0; x < 256; x++) {
+	lut[sym][c][x] = 0;
+	for (k = 0; k < 8; k++) {
+	  pos = 8*c + k;
+	  expect = pos >= sym_low_len[sym];
+	  lut[sym][c][x] += ((x >> k) & 1) != expect;
+	}
+      }
+    }
+  }
+  lut_ready = 1;
+}
+
+static void lut_prepare(uint32_t len)
+{
+  uint32_t i;
+
+  if (!lut_ready) lut_init();
+  if (len > BLEN) len = BLEN;
+  if (len <= lut_len) return;
+
+  for (i = lut_len; i < len; i++)
+    lut_packed[i/8] = (lut_packed[i/8] & ~(1 << (i % 8))) | bits[i] << (i % 8);
+  lut_len = len;
+}
+
+static uint32_t lut_score(uint32_t samp_idx, uint32_t sym)
+{
+  uint32_t c, i, shift, sum = 0;
+  uint8_t *p;
+
+  if (__builtin_expect(samp_idx + SAMPLES_PER_SEC > lut_len, 0))
+    lut_prepare(samp_idx + SAMPLES_PER_SEC);
+
+  p = &lut_packed[samp_idx/8];
+  shift = samp_idx % 8;
+  for (c = 0; c < LUT_CHUNKS; c++) {
+    i = ((p[c] | p[c + 1] << 8) >> shift) & 0xff;
+    sum += lut[sym][c][i];
+  }
+
+  return sum;
+}
+
+static void lut_invalidate(uint32_t from)
+{
+  if (from < lut_len) lut_len = from;
+}
+
+engine_t lut_engine = {"lut", lut_prepare, lut_score, lut_invalidate, 1};
+
+static engine_t *engines[] = {&cache_engine, &bitslice_engine, &lut_engine, &llr_engine, &xor_engine};
+
+/* The engine in use by this thread */
+__thread engine_t *engine = &cache_engine;
+
+/* Engine by name, or NULL */
+
+engine_t *engine_find(char *name)
+{
+  uint32_t i;
+
+  for (i = 0; i < sizeof(engines)/sizeof(engines[0]); i++)
+    if (strcmp(engines[i]->name, name) == 0) return engines[i];
+
+  return NULL;
+}
+
+/* The ith engine, or NULL past the last */
+
+engine_t *engine_nth(uint32_t i)
+{
+  return i < sizeof(engines)/sizeof(engines[0]) ? engines[i] : NULL;
+}
+
+/* Print the names of the engines, separated by spaces */
+
+void engine_list(FILE *fp)
+{
+  uint32_t i;
+
+  for (i = 0; i < sizeof(engines)/sizeof(engines[0]); i++)
+    fprintf(fp, "%s%s", i ? " " : "", engines[i]->name);
+}
+
+/* bits[] has changed from sample from on, tell every engine */
+
+void engine_invalidate(uint32_t from)
+{
+  uint32_t i;
+
+  for (i = 0; i < sizeof(engines)/sizeof(engines[0]); i++) engines[i]->invalidate(from);
+}
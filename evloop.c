@@ -0,0 +1,480 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Single threaded event loop decoding, for one core machines like the Pi
+ * Zero.  Instead of spinning in wait_until() for every sample, the process
+ * sleeps in epoll_wait() and is woken by a timerfd at each sample time.
+ * Between samples the decode runs in short slices: bringing the engine's
+ * table up to date with the new samples, searching a run of frame starts
+ * with find_frame_from(), decoding one field of the frame found, then
+ * printing and saving the decode.  A slice is only started when a whole
+ * budget fits before the next sample is due, and the number of frame starts
+ * in a slice is halved whenever a slice runs over budget and doubled when it
+ * uses well under, so the search keeps within the budget.  The other slices
+ * (ten seconds of engine table, one field, the output, a control request)
+ * are short but not sized to the budget, and can run over it on a slow
+ * machine; the longest slice and the slices over budget are reported with
+ * every decode.
+ *
+ * With -S the control socket and its clients are in the loop's epoll set as
+ * well, and each request ready is answered as a slice of its own.
+ *
+ * After a confident decode the next frame starts a minute later, at the
+ * same sample once the buffer has moved down, so with -E its fields are
+ * decoded early (see early.c) in slices as their seconds arrive.
+ *
+ * Like -C, the last two minutes are kept in bits[], the starts in the first
+ * minute are searched as the second minute arrives, and every frame is
+ * decoded once.  Samples that arrive before the search of a full buffer has
+ * finished wait in a side buffer.
+ *
+ * With a gpiochip device the loop sleeps until the receiver output changes
+ * instead: the kernel timestamps each edge, and the samples between edges
+ * are filled in from those times once a second or at the next edge, so the
+ * process wakes a few times a second rather than 40.
+ *
+ * Sources on a virtual clock (the simulator, edge log replay) are stepped
+ * with wait_until() in place of the timerfd.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <linux/gpio.h>
+
+#include "wwvb_dec.h"
+
+#define EV_CHUNK (60*SAMPLES_PER_SEC)
+
+/* Samples of the engine table brought up to date in one slice */
+#define EV_PREPARE_STEP (10*SAMPLES_PER_SEC)
+
+/* Edge events are filled in this long after the sample time, for the event
+ * to have reached us, usec */
+#define EV_EDGE_LAG_USEC 5000
+
+#define EV_EDGES 64
+
+#define EV_EVENTS 8
+
+static source_t *ev_src;
+static uint64_t ev_first;             /* source time of sample 0 */
+static uint64_t ev_base;              /* sample number of bits[0] */
+static uint32_t ev_len;               /* samples in bits[] */
+static uint8_t ev_pend[EV_CHUNK];     /* samples after a full bits[] */
+static uint32_t ev_pend_len;
+static uint32_t ev_prepared;          /* samples the engine table covers */
+static uint32_t ev_searched;          /* frame starts searched */
+static uint32_t ev_frame_idx, ev_min_val;
+static uint32_t ev_step;              /* of the decode, see ev_decode() */
+static uint32_t ev_score;
+static int32_t ev_early_idx = -1;     /* predicted frame start for -E, or -1 */
+static uint32_t ev_early;             /* samples given to early_sample() */
+
+/* Control socket fds with a request ready */
+static int ev_ctl[EV_EVENTS];
+static uint32_t ev_nctl;
+
+static uint32_t ev_budget;
+static uint32_t ev_chunk = SAMPLES_PER_SEC;
+
+/* Per decode statistics */
+static uint32_t ev_late_max, ev_missed, ev_slice_max, ev_over, ev_samples;
+static uint64_t ev_late_sum;
+
+/* Edges from the gpiochip, oldest first */
+static struct {
+  uint64_t t;
+  uint32_t level;
+} ev_edges[EV_EDGES];
+static uint32_t ev_edge_head, ev_edge_tail;
+static uint32_t ev_level;
+
+/* Add a sample to bits[], or the side buffer if bits[] is full and not yet
+ * decoded */
+
+static void ev_sample(uint32_t level, uint64_t late)
+{
+  if (ev_len < BLEN) {
+    bits[ev_len++] = level;
+  } else if (ev_pend_len < EV_CHUNK) {
+    ev_pend[ev_pend_len++] = level;
+  } else {
+    /* A whole minute behind, start again */
+    fprintf(stderr, "Warning: decoder fell behind, %u minute(s) of samples dropped\n",
+	    (ev_len + ev_pend_len)/EV_CHUNK);
+    ev_base += ev_len + ev_pend_len;
+    ev_len = 0;
+    ev_pend_len = 0;
+    ev_prepared = 0;
+    ev_searched = 0;
+    ev_step = 0;
+    ev_early_idx = -1;
+    ev_min_val = SAMPLES_PER_SEC*120*engine->one;
+    engine_invalidate(0);
+    bits[ev_len++] = level;
+  }
+
+  if (late > ev_late_max) ev_late_max = late;
+  ev_late_sum += late;
+  ev_samples++;
+}
+
+/* Level of the receiver at source time t from the edges.  Edges at or
+ * before t are consumed. */
+
+static uint32_t ev_edge_level(uint64_t t)
+{
+  while (ev_edge_tail != ev_edge_head && ev_edges[ev_edge_tail % EV_EDGES].t <= t) {
+    ev_level = ev_edges[ev_edge_tail % EV_EDGES].level;
+    ev_edge_tail++;
+  }
+
+  return ev_level;
+}
+
+/* Take in the edge events waiting on fd */
+
+static void ev_read_edges(int fd)
+{
+  struct gpio_v2_line_event ev[16];
+  ssize_t n;
+  uint32_t i;
+
+  while ((n = read(fd, ev, sizeof(ev))) > 0) {
+    for (i = 0; i < n/sizeof(ev[0]); i++) {
+      if (ev_edge_head - ev_edge_tail == EV_EDGES) {
+	/* Too noisy to keep every edge, fold in the oldest */
+	ev_level = ev_edges[ev_edge_tail % EV_EDGES].level;
+	ev_edge_tail++;
+      }
+      ev_edges[ev_edge_head % EV_EDGES].t = ev[i].timestamp_ns/1000;
+      ev_edges[ev_edge_head % EV_EDGES].level = ev[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE;
+      ev_edge_head++;
+    }
+  }
+}
+
+/* Request edge events for the receiver GPIO from a gpiochip device.  Returns
+ * the event fd, or -1. */
+
+static int ev_open_edges(char *chipname)
+{
+  struct gpio_v2_line_request req;
+  int fd;
+
+  if ((fd = open(chipname, O_RDONLY)) < 0) {
+    fprintf(stderr, "Error: could not open %s\n", chipname);
+    return -1;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.offsets[0] = GPIO;
+  req.num_lines = 1;
+  strcpy(req.consumer, "wwvb_dec");
+  req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING |
+    GPIO_V2_LINE_FLAG_EDGE_FALLING;
+  if (ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+    fprintf(stderr, "Error: could not request edge events for GPIO %u from %s\n", GPIO, chipname);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  fcntl(req.fd, F_SETFL, O_NONBLOCK);
+
+  return req.fd;
+}
+
+/* Slices are timed on the host clock, also for sources on a virtual clock */
+
+static uint64_t ev_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+}
+
+static int ev_timer_set(int fd, uint64_t first, uint64_t interval)
+{
+  struct itimerspec its;
+
+  its.it_value.tv_sec = first/1000000;
+  its.it_value.tv_nsec = first % 1000000*1000;
+  its.it_interval.tv_sec = interval/1000000;
+  its.it_interval.tv_nsec = interval % 1000000*1000;
+
+  return timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* One step of the decode of the frame found in the first minute: report the
+ * frame, decode each field, print the decode, then save it and move the
+ * second minute (and any samples waiting) down to make room for the next */
+
+static void ev_decode(int print_flag, char *outfilename, uint32_t *n)
+{
+  uint64_t local;
+  int32_t minute;
+  uint32_t step = ev_step++;
+
+  if (step == 0) {
+    printf("\nFound frame at sample %u, score %u, latest sample %u usec, mean %u usec, %u missed\n",
+	   ev_frame_idx, score_errors(ev_min_val), ev_late_max,
+	   ev_samples ? (uint32_t)(ev_late_sum/ev_samples) : 0, ev_missed);
+    printf("  Event loop: longest slice %u usec, %u over budget\n", ev_slice_max, ev_over);
+    if (print_flag) print_frame(ev_frame_idx);
+    ev_score = 0;
+    return;
+  }
+
+  if (step <= NUM_FIELDS) {
+    TRACE_BEGIN("decode_frame");
+    if (perf_enabled) perf_begin(PERF_DECODE_FRAME);
+    ev_score += decode_frame_field(ev_frame_idx, step - 1);
+    if (perf_enabled) perf_end(PERF_DECODE_FRAME, frame[step - 1].code_len);
+    TRACE_END("decode_frame");
+    return;
+  }
+
+  if (step == NUM_FIELDS + 1) {
+    print_decode(ev_score);
+    if (perf_enabled) perf_report();
+
+    local = ev_first + (ev_base + ev_frame_idx)*SAMP_PERIOD_USEC;
+    control_decode(ev_base/EV_CHUNK, local, ev_frame_idx, ev_min_val, ev_score, ev_late_max, ev_missed);
+
+    minute = frame_minute();
+    ev_early_idx = -1;
+    if (frame_worst_score() < verdict_ok*engine->one && minute >= 0) {
+      flywheel_update(local, minute);
+      flywheel_print(ev_first + (ev_base + BLEN)*SAMP_PERIOD_USEC);
+      ev_early_idx = ev_frame_idx;
+    }
+    fflush(stdout);
+    return;
+  }
+
+  if (outfilename != NULL) save_buffer_file(outfilename);
+  (*n)++;
+  ev_step = 0;
+
+  memmove(bits, bits + EV_CHUNK, BLEN - EV_CHUNK);
+  memcpy(bits + BLEN - EV_CHUNK, ev_pend, ev_pend_len);
+  ev_len = BLEN - EV_CHUNK + ev_pend_len;
+  ev_pend_len = 0;
+  ev_base += EV_CHUNK;
+  engine_invalidate(0);
+  ev_prepared = 0;
+  ev_searched = 0;
+  ev_min_val = SAMPLES_PER_SEC*120*engine->one;
+
+  ev_late_max = 0;
+  ev_late_sum = 0;
+  ev_samples = 0;
+  ev_missed = 0;
+  ev_slice_max = 0;
+  ev_over = 0;
+
+  if (early_enabled) early_start(ev_early_idx);
+  ev_early = 0;
+}
+
+/* One slice of decode work.  Returns 0 if there was nothing to do. */
+
+static int ev_slice(int print_flag, char *outfilename, uint32_t *n)
+{
+  uint32_t to, limit;
+
+  if (ev_nctl > 0) {
+    control_event(ev_ctl[--ev_nctl]);
+    return 1;
+  }
+
+  /* Fields of the predicted frame whose seconds have arrived */
+  if (early_enabled && ev_early_idx >= 0 && ev_early < ev_len) {
+    ev_early = ev_len;
+    early_sample(ev_len - 1);
+    return 1;
+  }
+
+  /* A second at a time, or the rest of a full buffer */
+  if (ev_prepared < ev_len && (ev_prepared + SAMPLES_PER_SEC <= ev_len || ev_len == BLEN)) {
+    to = ev_prepared + EV_PREPARE_STEP < ev_len ? ev_prepared + EV_PREPARE_STEP : ev_len;
+    engine->prepare(to);
+    ev_prepared = to;
+    return 1;
+  }
+
+  /* Starts whose whole frame has been sampled, in the first minute */
+  limit = ev_prepared > EV_CHUNK ? ev_prepared - EV_CHUNK : 0;
+  if (limit > EV_CHUNK) limit = EV_CHUNK;
+  if (ev_searched < limit) {
+    to = ev_searched + ev_chunk < limit ? ev_searched + ev_chunk : limit;
+    find_frame_from(ev_searched, to + EV_CHUNK, &ev_frame_idx, &ev_min_val);
+    ev_searched = to;
+    return 1;
+  }
+
+  if (ev_searched == EV_CHUNK) {
+    ev_decode(print_flag, outfilename, n);
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Run slices while a whole budget fits before the next sample is due */
+
+static void ev_work(uint64_t next_due, int print_flag, char *outfilename, uint32_t *n)
+{
+  uint64_t t, took;
+  int more = 1;
+
+  while (more && !wwvb_stop && ev_src->now() + ev_budget < next_due) {
+    t = ev_usec();
+    TRACE_BEGIN("slice");
+    more = ev_slice(print_flag, outfilename, n);
+    TRACE_END("slice");
+    took = ev_usec() - t;
+    if (took > ev_slice_max) ev_slice_max = took;
+    if (took > ev_budget) {
+      ev_over++;
+      if (ev_chunk > 1) ev_chunk /= 2;
+    } else if (took < ev_budget/4 && 2*ev_chunk <= EV_CHUNK) {
+      ev_chunk *= 2;
+    }
+  }
+}
+
+/* Decode every minute, count times (forever if 0), sampling from a timerfd
+ * or gpiochip edge events and decoding in slices of at most budget_usec.
+ * chipname is the gpiochip device, or NULL to sample with the timer.  The
+ * samples of each decode are saved to outfilename if it is not NULL. */
+
+int evloop_run(source_t *src, uint32_t count, uint32_t budget_usec, char *chipname, int print_flag,
+	       char *outfilename)
+{
+  struct epoll_event ev, events[EV_EVENTS];
+  int epfd = -1, tfd = -1, efd = -1, virt, i, nev;
+  uint64_t due, now, expirations, flush_to;
+  uint32_t n = 0, level;
+
+  ev_src = src;
+  ev_budget = budget_usec;
+  virt = src != &gpio_source;
+  if (virt && chipname != NULL) {
+    fprintf(stderr, "Error: gpiochip edges need the GPIO receiver\n");
+    return -1;
+  }
+
+  ev_first = src->now() + SAMP_PERIOD_USEC;
+  ev_base = 0;
+  ev_len = 0;
+  ev_pend_len = 0;
+  ev_prepared = 0;
+  ev_searched = 0;
+  ev_step = 0;
+  ev_nctl = 0;
+  ev_early_idx = -1;
+  ev_min_val = SAMPLES_PER_SEC*120*engine->one;
+  engine_invalidate(0);
+
+  if ((epfd = epoll_create1(0)) < 0 || control_epoll(epfd) < 0) {
+    fprintf(stderr, "Error: could not create event loop\n");
+    if (epfd >= 0) close(epfd);
+    return -1;
+  }
+
+  if (!virt) {
+    if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+      fprintf(stderr, "Error: could not create event loop\n");
+      close(epfd);
+      return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = tfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+
+    if (chipname != NULL) {
+      if ((efd = ev_open_edges(chipname)) < 0) {
+	close(tfd);
+	close(epfd);
+	return -1;
+      }
+      ev.data.fd = efd;
+      epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &ev);
+      ev_level = src->read();
+      ev_edge_head = ev_edge_tail = 0;
+      /* Only a wake up to fill in the samples of a quiet second */
+      ev_timer_set(tfd, ev_first, 1000000);
+    } else {
+      ev_timer_set(tfd, ev_first, SAMP_PERIOD_USEC);
+    }
+  }
+
+  while ((count == 0 || n < count) && !wwvb_stop) {
+
+    due = ev_first + (ev_base + ev_len + ev_pend_len)*SAMP_PERIOD_USEC;
+
+    /* Control requests are taken as they are seen ready, and still ready
+     * next time if there was no time for them */
+    ev_nctl = 0;
+
+    if (virt) {
+      src->wait_until(due);
+      ev_sample(src->read(), src->now() - due);
+      /* Only the control socket is in the set */
+      nev = epoll_wait(epfd, events, EV_EVENTS, 0);
+      for (i = 0; i < nev; i++) ev_ctl[ev_nctl++] = events[i].data.fd;
+    } else {
+      TRACE_BEGIN("epoll_wait");
+      nev = epoll_wait(epfd, events, EV_EVENTS, -1);
+      TRACE_END("epoll_wait");
+      if (nev < 0 && errno != EINTR) break;
+
+      for (i = 0; i < nev; i++) {
+	if (events[i].data.fd == efd) {
+	  ev_read_edges(efd);
+	} else if (events[i].data.fd != tfd) {
+	  ev_ctl[ev_nctl++] = events[i].data.fd;
+	} else if (read(tfd, &expirations, sizeof(expirations)) == sizeof(expirations) &&
+		   chipname == NULL) {
+	  /* Later samples whose time has also passed were missed, they take the
+	   * level now to keep the timing of the rest */
+	  now = src->now();
+	  level = src->read();
+	  ev_sample(level, now - due);
+	  for (due += SAMP_PERIOD_USEC; due <= now; due += SAMP_PERIOD_USEC) {
+	    ev_sample(level, now - due);
+	    ev_missed++;
+	  }
+	}
+      }
+
+      /* Samples from the edges, up to the last sample the events can be
+       * relied on for */
+      if (chipname != NULL) {
+	now = src->now();
+	flush_to = now > EV_EDGE_LAG_USEC ? now - EV_EDGE_LAG_USEC : 0;
+	for (; due <= flush_to; due += SAMP_PERIOD_USEC) ev_sample(ev_edge_level(due), 0);
+      }
+    }
+
+    due = ev_first + (ev_base + ev_len + ev_pend_len)*SAMP_PERIOD_USEC;
+    ev_work(virt || chipname == NULL ? due : due + EV_EDGE_LAG_USEC, print_flag, outfilename, &n);
+  }
+
+  if (efd >= 0) close(efd);
+  if (tfd >= 0) close(tfd);
+  if (epfd >= 0) close(epfd);
+
+  return 0;
+}
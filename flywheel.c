@@ -0,0 +1,202 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Holdover flywheel.  The on-time markers of confident decodes are fitted
+ * against the local monotonic clock of the sample source, giving the local
+ * clock's frequency offset.  Between decodes the flywheel then serves WWVB time
+ * at any instant, with an uncertainty that grows with time since the fit data.
+ *
+ * The fit is a least squares line through the last FW_POINTS markers, local
+ * time against WWVB time.  Marker times are only known to a sample period, so
+ * the residual error is never taken as less than that quantization.  The
+ * uncertainty is twice the standard error of the fit's prediction, plus an
+ * allowance for the local oscillator wandering since the last marker.
+ *
+ * The fit is published under a sequence lock, so flywheel_now() can be called
+ * from any thread without blocking the decoder, and is constant time.
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#include "wwvb_dec.h"
+
+#define FW_POINTS 64
+
+/* Assumed local clock error before there are two markers to fit */
+#define FW_PRIOR_PPM 100
+
+/* Local oscillator wander, ppm per hour since the last marker */
+#define FW_WANDER_PPM_PER_HOUR 0.5
+
+/* Quantization error of a marker time, standard deviation in seconds */
+#define FW_SIGMA_Q (SAMP_PERIOD/1000.0/sqrt(12))
+
+/* Markers of the current lock, WWVB time (usec since Unix epoch) and local
+ * time */
+static struct {
+  uint64_t utc;
+  uint64_t local;
+} fw_points[FW_POINTS];
+static uint32_t fw_npoints, fw_next;
+
+/* Published fit.  Times are seconds relative to utc_base and local_base. */
+static _Atomic uint32_t fw_seq;
+static struct {
+  int locked;
+  uint64_t utc_base, local_base;
+  uint32_t n;
+  double a, b;       /* local = a + b*utc */
+  double x_mean, sxx, sigma;
+  double x_last;     /* utc of latest marker */
+} fw;
+
+/* Local oscillator error, ppm, positive if it runs fast */
+
+static double fw_ppm(void)
+{
+  return (fw.b - 1)*1e6;
+}
+
+static void fw_fit(void)
+{
+  uint32_t i, n = fw_npoints;
+  double x, y, sx = 0, sy = 0, sxx = 0, sxy = 0, r, ss = 0;
+  uint64_t utc_base = fw_points[(fw_next + FW_POINTS - n) % FW_POINTS].utc;
+  uint64_t local_base = fw_points[(fw_next + FW_POINTS - n) % FW_POINTS].local;
+
+  for (i = 0; i < n; i++) {
+    x = (int64_t)(fw_points[i].utc - utc_base)/1e6;
+    y = (int64_t)(fw_points[i].local - local_base)/1e6;
+    sx += x;
+    sy += y;
+  }
+  sx /= n;
+  sy /= n;
+  for (i = 0; i < n; i++) {
+    x = (int64_t)(fw_points[i].utc - utc_base)/1e6 - sx;
+    y = (int64_t)(fw_points[i].local - local_base)/1e6 - sy;
+    sxx += x*x;
+    sxy += x*y;
+  }
+
+  atomic_fetch_add_explicit(&fw_seq, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  fw.locked = 1;
+  fw.utc_base = utc_base;
+  fw.local_base = local_base;
+  fw.n = n;
+  fw.b = sxx > 0 ? sxy/sxx : 1;
+  fw.a = sy - fw.b*sx;
+  fw.x_mean = sx;
+  fw.sxx = sxx;
+  fw.x_last = (int64_t)(fw_points[(fw_next + FW_POINTS - 1) % FW_POINTS].utc - utc_base)/1e6;
+
+  if (n > 2) {
+    for (i = 0; i < n; i++) {
+      r = (int64_t)(fw_points[i].local - local_base)/1e6 -
+	(fw.a + fw.b*(int64_t)(fw_points[i].utc - utc_base)/1e6);
+      ss += r*r;
+    }
+    fw.sigma = sqrt(ss/(n - 2));
+  }
+  if (n <= 2 || fw.sigma < FW_SIGMA_Q) fw.sigma = FW_SIGMA_Q;
+
+  atomic_thread_fence(memory_order_release);
+  atomic_fetch_add_explicit(&fw_seq, 1, memory_order_relaxed);
+}
+
+/* WWVB time, usec since the Unix epoch, and its uncertainty in usec, at local
+ * source time.  Returns 0 if there has not been a confident decode yet. */
+
+int flywheel_now(uint64_t local, uint64_t *utc, uint64_t *unc)
+{
+  uint32_t seq;
+  double x, y, u, hours;
+  int locked;
+
+  do {
+    while ((seq = atomic_load_explicit(&fw_seq, memory_order_acquire)) & 1) {}
+
+    if (!(locked = fw.locked)) return 0;
+    y = (int64_t)(local - fw.local_base)/1e6;
+    x = (y - fw.a)/fw.b;
+    *utc = fw.utc_base + (int64_t)(x*1e6);
+
+    hours = (x - fw.x_last)/3600;
+    if (hours < 0) hours = -hours;
+    if (fw.n < 2) {
+      u = 2*fw.sigma + FW_PRIOR_PPM*1e-6*fabs(x - fw.x_last);
+    } else {
+      u = 2*fw.sigma*sqrt(1.0/fw.n + (x - fw.x_mean)*(x - fw.x_mean)/fw.sxx);
+    }
+    u += 0.5*FW_WANDER_PPM_PER_HOUR*1e-6*3600*hours*hours;
+
+    atomic_thread_fence(memory_order_acquire);
+  } while (atomic_load_explicit(&fw_seq, memory_order_relaxed) != seq);
+
+  *unc = u*1e6;
+  return locked;
+}
+
+/* Add the on-time marker of a confident decode: local source time of the
+ * start of the frame, and the minute it is for.  A marker that disagrees with
+ * the flywheel by more than its uncertainty starts a new fit. */
+
+void flywheel_update(uint64_t local, int32_t minute)
+{
+  uint64_t utc, pred, unc;
+
+  utc = ((uint64_t)minute*60 + EPOCH_2000)*1000000ULL;
+
+  if (flywheel_now(local, &pred, &unc)) {
+    if ((pred > utc ? pred - utc : utc - pred) > 2*unc + SAMP_PERIOD_USEC) {
+      printf("  Flywheel: off by %.1f ms, restarting\n", ((double)pred - (double)utc)/1000);
+      fw_npoints = 0;
+      fw_next = 0;
+    }
+  }
+
+  fw_points[fw_next].utc = utc;
+  fw_points[fw_next].local = local;
+  fw_next = (fw_next + 1) % FW_POINTS;
+  if (fw_npoints < FW_POINTS) fw_npoints++;
+
+  fw_fit();
+}
+
+/* Forget the lock, the next marker starts a new fit */
+
+void flywheel_reset(void)
+{
+  fw_npoints = 0;
+  fw_next = 0;
+
+  atomic_fetch_add_explicit(&fw_seq, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  fw.locked = 0;
+  atomic_thread_fence(memory_order_release);
+  atomic_fetch_add_explicit(&fw_seq, 1, memory_order_relaxed);
+}
+
+/* Print flywheel time at local source time */
+
+void flywheel_print(uint64_t local)
+{
+  uint64_t utc, unc;
+  uint32_t secs;
+  int32_t minute;
+  uint32_t year, daynum, hours, minutes, lyi;
+
+  if (!flywheel_now(local, &utc, &unc)) return;
+
+  minute = (utc/1000000 - EPOCH_2000)/60;
+  secs = utc/1000000 % 60;
+  minute_to_fields(minute, &year, &daynum, &hours, &minutes, &lyi);
+
+  printf("  Flywheel: %02u:%02u:%02u.%03u UTC day %03u of year %02u, +/- %.1f ms, clock %+.2f ppm (%u markers)\n",
+	 hours, minutes, secs, (uint32_t)(utc/1000 % 1000), daynum, year, unc/1000.0, fw_ppm(), fw.n);
+}
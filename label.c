@@ -0,0 +1,214 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Automatic labeling.  A long recording (usually an edge log replayed with
+ * -i) is decoded minute by minute as in -C, and each minute's two minute
+ * buffer is saved to a directory.  Confident decodes are anchors, and a
+ * stretch is a run of anchors that agree with each other: the minutes between
+ * any two match the time between their frame starts, and LSW and DST do not
+ * change.  Every minute of a stretch of at least LABEL_MIN_ANCHORS anchors,
+ * weak or failed decodes included, is labeled with the time and frame start
+ * that follow from the anchors either side.  Buffers that are not labeled
+ * are deleted, and the labels are written to index.txt in the directory:
+ *
+ *   file       minute  yy/ddd hh:mm  frame_idx  anchor|inferred  decoded  worst
+ *
+ * minute is the true minute since 2000, frame_idx where its frame starts in
+ * the buffer, decoded the minute the decoder found (-1 if none) and worst its
+ * worst second, so a corpus from a noisy night shows how often each engine
+ * gets the weak minutes right.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wwvb_dec.h"
+
+#define LABEL_CHUNK (60*SAMPLES_PER_SEC)
+
+/* Anchors needed for a stretch to be trusted */
+#define LABEL_MIN_ANCHORS 3
+
+/* Disagreement allowed between anchors, usec plus ppm of the time between */
+#define LABEL_TOL_USEC (2*SAMP_PERIOD_USEC)
+#define LABEL_TOL_PPM 100
+
+typedef struct {
+  uint64_t first;       /* source time of the buffer's first sample */
+  uint64_t local;       /* source time of the decoded frame start */
+  uint32_t frame_idx;
+  uint32_t worst;
+  int32_t minute;       /* decoded, -1 if not a valid time */
+  uint32_t lsw, dst;
+  int anchor;
+  int32_t label;        /* true minute, -1 if not labeled */
+  uint32_t label_idx;
+  int label_anchor;
+} label_rec_t;
+
+static label_rec_t *label_recs;
+static uint32_t label_nrecs, label_cap;
+
+static void label_fname(char *buf, size_t size, char *dir, uint32_t k)
+{
+  snprintf(buf, size, "%s/min_%05u.bin", dir, k);
+}
+
+/* Whether anchors a and b, a first, agree */
+
+static int label_agree(label_rec_t *a, label_rec_t *b)
+{
+  int64_t dt, expect, diff;
+
+  if (b->minute <= a->minute || a->lsw != b->lsw || a->dst != b->dst) return 0;
+  dt = b->local - a->local;
+  expect = (int64_t)(b->minute - a->minute)*60000000LL;
+  diff = dt > expect ? dt - expect : expect - dt;
+
+  return diff <= LABEL_TOL_USEC + expect/1000000*LABEL_TOL_PPM;
+}
+
+/* Label records from anchor a to anchor b from the time between them */
+
+static void label_between(label_rec_t *a, label_rec_t *b)
+{
+  label_rec_t *r;
+  double per_min;
+  int64_t j;
+  uint64_t t;
+
+  per_min = (b->local - a->local)/(double)(b->minute - a->minute);
+  for (r = a; r <= b; r++) {
+    /* The frame that starts in the first minute of the buffer */
+    j = r->first > a->local ? (int64_t)((r->first - a->local + per_min - 1)/per_min) : 0;
+    t = a->local + (uint64_t)(j*per_min + 0.5);
+    if (t < r->first || t >= r->first + (uint64_t)LABEL_CHUNK*SAMP_PERIOD_USEC) continue;
+    r->label = a->minute + j;
+    r->label_idx = (t - r->first + SAMP_PERIOD_USEC/2)/SAMP_PERIOD_USEC;
+    r->label_anchor = r->anchor && r->label == r->minute && r->label_idx == r->frame_idx;
+  }
+}
+
+/* Find the stretches and label them */
+
+static uint32_t label_stretches(void)
+{
+  uint32_t k, start = 0, last = 0, anchors = 0, labeled = 0, i, next;
+
+  for (k = 0; k <= label_nrecs; k++) {
+    if (k < label_nrecs && !label_recs[k].anchor) continue;
+
+    if (k < label_nrecs && anchors > 0 && label_agree(&label_recs[last], &label_recs[k])) {
+      anchors++;
+      last = k;
+      continue;
+    }
+
+    /* The stretch ends, label it if long enough */
+    if (anchors >= LABEL_MIN_ANCHORS) {
+      for (i = start; i < last; i = next) {
+	for (next = i + 1; !label_recs[next].anchor; next++) ;
+	label_between(&label_recs[i], &label_recs[next]);
+      }
+    }
+
+    start = last = k;
+    anchors = 1;
+  }
+
+  for (k = 0; k < label_nrecs; k++) labeled += label_recs[k].label >= 0;
+  return labeled;
+}
+
+static int label_write(char *dir, uint32_t *nanchors)
+{
+  char fname[1024];
+  FILE *fp;
+  uint32_t k, year, daynum, hours, minutes, lyi;
+  label_rec_t *r;
+
+  snprintf(fname, sizeof(fname), "%s/index.txt", dir);
+  if ((fp = fopen(fname, "w")) == NULL) {
+    fprintf(stderr, "Error: could not open file %s for writing\n", fname);
+    return -1;
+  }
+  fprintf(fp, "# file minute yy/ddd hh:mm frame_idx anchor|inferred decoded worst\n");
+
+  *nanchors = 0;
+  for (k = 0; k < label_nrecs; k++) {
+    r = &label_recs[k];
+    label_fname(fname, sizeof(fname), dir, k);
+    if (r->label < 0) {
+      unlink(fname);
+      continue;
+    }
+    minute_to_fields(r->label, &year, &daynum, &hours, &minutes, &lyi);
+    fprintf(fp, "min_%05u.bin %d %02u/%03u %02u:%02u %u %s %d %u\n", k, r->label, year, daynum,
+	    hours, minutes, r->label_idx, r->label_anchor ? "anchor" : "inferred", r->minute, r->worst);
+    *nanchors += r->label_anchor;
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+/* Decode every minute from src, count times (until the source ends if 0),
+ * and write a labeled corpus to dir */
+
+int label_run(source_t *src, uint32_t count, char *dir)
+{
+  char fname[1024];
+  uint64_t first;
+  uint32_t k, min_val, score, labeled, nanchors;
+  label_rec_t *r;
+
+  first = src->now();
+  fill_late_max = 0;
+  fill_buffer_from(src, 0, LABEL_CHUNK, first);
+
+  for (k = 0; (count == 0 || k < count) && !wwvb_stop; k++) {
+    fill_buffer_from(src, LABEL_CHUNK, BLEN, first + (uint64_t)k*LABEL_CHUNK*SAMP_PERIOD_USEC);
+    if (wwvb_stop) break;
+
+    if (k == label_cap) {
+      label_cap = label_cap ? 2*label_cap : 64;
+      if ((label_recs = realloc(label_recs, label_cap*sizeof(label_rec_t))) == NULL) {
+	fprintf(stderr, "Error: out of memory\n");
+	return -1;
+      }
+    }
+    r = &label_recs[k];
+    memset(r, 0, sizeof(*r));
+    r->first = first + (uint64_t)k*LABEL_CHUNK*SAMP_PERIOD_USEC;
+    r->label = -1;
+
+    /* Frame starts in the first minute, as in -C */
+    r->frame_idx = find_frame(BLEN, &min_val);
+    score = decode_frame(r->frame_idx);
+    r->local = r->first + (uint64_t)r->frame_idx*SAMP_PERIOD_USEC;
+    r->worst = score_errors(frame_worst_score());
+    r->minute = frame_minute();
+    r->lsw = frame[LSW].value;
+    r->dst = frame[DST].value;
+    r->anchor = r->minute >= 0 && frame_worst_score() < verdict_ok*engine->one;
+    label_nrecs = k + 1;
+
+    printf("Minute %u: frame at sample %u, score %u, worst %u%s\n", k, r->frame_idx, score_errors(score), r->worst,
+	   r->anchor ? ", anchor" : "");
+    label_fname(fname, sizeof(fname), dir, k);
+    save_buffer_file(fname);
+
+    memmove(bits, bits + LABEL_CHUNK, BLEN - LABEL_CHUNK);
+    engine_invalidate(0);
+  }
+
+  labeled = label_stretches();
+  if (label_write(dir, &nanchors) < 0) return -1;
+  printf("\nLabeled %u of %u minutes, %u confident decodes and %u inferred, in %s/index.txt\n",
+	 labeled, label_nrecs, nanchors, labeled - nanchors, dir);
+
+  return 0;
+}
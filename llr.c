@@ -0,0 +1,242 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Log-likelihood scoring engine.  The other engines count the samples that
+ * differ from the ideal symbol, as if an error were as likely at any position
+ * of a second as any other.  Real receivers are not like that: the edges of
+ * the reduced carrier wander and stretch, and noise may mostly show up as
+ * ones or mostly as zeros.  The llr engine scores a second by how unlikely
+ * its samples are for the symbol, from P(sample = 1 | symbol, position)
+ * learned from a labeled corpus:
+ *
+ *   score = (sum over positions of log Pmax - log P(sample | symbol, position)
+ *            + log Lmax - log Lsym) / D
+ *
+ * where Pmax is the more likely value's probability at the position, so the
+ * likeliest samples for a symbol cost nothing and no sample less, Lsym is
+ * the likelihood of those samples and Lmax the largest of the three, so the
+ * symbols still compare as their likelihoods do, and D is the log-likelihood
+ * ratio of an error at the corpus's average error rate, so one typical error
+ * still costs about 1 and the verdict thresholds keep their meaning.  Scores
+ * are fixed point in 1/LLR_ONE, the engine's one, all the way through the
+ * frame search and decode, and each sample's cost is capped at LLR_CAP.
+ * With no table every position has the same error rate and the engine
+ * scores exactly LLR_ONE times xor.
+ *
+ * -U directory learns a table from a corpus labeled by -A, counting for each
+ * symbol and position the ones seen in the seconds whose symbol is known
+ * (the fixed seconds and the time fields, not DUT1, LSW or DST), and writes
+ * it to the -Y file.  -Y alone loads it for -e llr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "wwvb_dec.h"
+
+#define LLR_ONE 256
+#define LLR_CAP (4*LLR_ONE)
+
+/* Ones and samples seen at each position of each symbol, with one of each
+ * added so nothing is certain */
+static uint32_t llr_ones[3][SAMPLES_PER_SEC];
+static uint32_t llr_total[3][SAMPLES_PER_SEC];
+
+/* llr_cost[sym][j][x] is the cost of sample value x at position j of sym.
+ * A second scores llr_base[sym], the cost of all zeros, plus llr_delta[sym][j]
+ * for each one, which the compiler can vectorize. */
+static uint16_t llr_cost[3][SAMPLES_PER_SEC][2];
+static int32_t llr_base[3];
+static int16_t llr_delta[3][SAMPLES_PER_SEC];
+static int llr_ready;
+
+/* A table has been loaded or learned, so llr no longer scores as xor */
+int llr_loaded;
+
+/* Costs from the counts */
+
+static void llr_costs(void)
+{
+  uint32_t sym, j, x, errors = 0, total = 0, low;
+  double p, pe, d, c, lmax, best[3], top = -1e9;
+
+  for (sym = 0; sym < 3; sym++) {
+    low = sym == 0 ? 200/SAMP_PERIOD : sym == 1 ? 500/SAMP_PERIOD : 800/SAMP_PERIOD;
+    best[sym] = 0;
+    for (j = 0; j < SAMPLES_PER_SEC; j++) {
+      errors += j < low ? llr_ones[sym][j] : llr_total[sym][j] - llr_ones[sym][j];
+      total += llr_total[sym][j];
+      p = (double)llr_ones[sym][j]/llr_total[sym][j];
+      best[sym] += log(p > 0.5 ? p : 1 - p);
+    }
+    if (best[sym] > top) top = best[sym];
+  }
+  pe = (double)errors/total;
+  d = log((1 - pe)/pe);
+
+  for (sym = 0; sym < 3; sym++) {
+    llr_base[sym] = LLR_ONE*(top - best[sym])/d + 0.5;
+    for (j = 0; j < SAMPLES_PER_SEC; j++) {
+      p = (double)llr_ones[sym][j]/llr_total[sym][j];
+      lmax = log(p > 0.5 ? p : 1 - p);
+      for (x = 0; x < 2; x++) {
+	c = LLR_ONE*(lmax - log(x ? p : 1 - p))/d + 0.5;
+	llr_cost[sym][j][x] = c > LLR_CAP ? LLR_CAP : (uint16_t)c;
+      }
+      llr_base[sym] += llr_cost[sym][j][0];
+      llr_delta[sym][j] = llr_cost[sym][j][1] - llr_cost[sym][j][0];
+    }
+  }
+  llr_ready = 1;
+}
+
+/* The table with no learning: the same small error rate everywhere */
+
+static void llr_default(void)
+{
+  uint32_t sym, j, low;
+
+  for (sym = 0; sym < 3; sym++) {
+    low = sym == 0 ? 200/SAMP_PERIOD : sym == 1 ? 500/SAMP_PERIOD : 800/SAMP_PERIOD;
+    for (j = 0; j < SAMPLES_PER_SEC; j++) {
+      llr_total[sym][j] = 100;
+      llr_ones[sym][j] = j < low ? 1 : 99;
+    }
+  }
+  llr_costs();
+}
+
+static void llr_prepare(uint32_t len)
+{
+  if (!llr_ready) llr_default();
+}
+
+static uint32_t llr_score(uint32_t samp_idx, uint32_t sym)
+{
+  uint32_t j;
+  int32_t sum;
+  uint8_t *p = &bits[samp_idx];
+  int16_t *d = llr_delta[sym];
+
+  if (__builtin_expect(!llr_ready, 0)) llr_default();
+  sum = llr_base[sym];
+  for (j = 0; j < SAMPLES_PER_SEC; j++) sum += d[j]*p[j];
+
+  return sum;
+}
+
+static void llr_invalidate(uint32_t from)
+{
+}
+
+engine_t llr_engine = {"llr", llr_prepare, llr_score, llr_invalidate, LLR_ONE};
+
+/* Load a table written by llr_learn().  Returns -1 if it can not be read. */
+
+int llr_load(char *fname)
+{
+  FILE *fp;
+  char line[128];
+  uint32_t sym, j, ones, total, n = 0;
+
+  if ((fp = fopen(fname, "r")) == NULL) {
+    fprintf(stderr, "Error: could not open file %s for reading\n", fname);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == '#') continue;
+    if (sscanf(line, "%u %u %u %u", &sym, &j, &ones, &total) != 4 || sym > 2 ||
+	j >= SAMPLES_PER_SEC || total == 0 || ones >= total) {
+      fprintf(stderr, "Error: bad line in table file %s: %s", fname, line);
+      fclose(fp);
+      return -1;
+    }
+    llr_ones[sym][j] = ones;
+    llr_total[sym][j] = total;
+    n++;
+  }
+  fclose(fp);
+
+  if (n != 3*SAMPLES_PER_SEC) {
+    fprintf(stderr, "Error: table file %s has %u of %u entries, built for another SAMP_PERIOD?\n",
+	    fname, n, 3*SAMPLES_PER_SEC);
+    return -1;
+  }
+  llr_costs();
+  llr_loaded = 1;
+  return 0;
+}
+
+/* Learn a table from the corpus in dir and write it to fname */
+
+int llr_learn(char *dir, char *fname)
+{
+  char path[1024], line[1024], file[256];
+  uint8_t known[60], secs[60];
+  uint32_t sym, i, j, frame_idx, files = 0, s;
+  int32_t minute;
+  FILE *fp;
+
+  frame_time_secs(known);
+  for (sym = 0; sym < 3; sym++) {
+    for (j = 0; j < SAMPLES_PER_SEC; j++) {
+      llr_ones[sym][j] = 1;
+      llr_total[sym][j] = 2;
+    }
+  }
+
+  snprintf(path, sizeof(path), "%s/index.txt", dir);
+  if ((fp = fopen(path, "r")) == NULL) {
+    fprintf(stderr, "Error: could not open file %s for reading\n", path);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == '#' || sscanf(line, "%255s %d %*s %*s %u", file, &minute, &frame_idx) != 3)
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    fill_buffer_file(path);
+    encode_frame(minute, 0, 0, secs);
+    for (i = 0; i < 60; i++) {
+      s = frame_idx + i*SAMPLES_PER_SEC;
+      if (!known[i] || s + SAMPLES_PER_SEC > BLEN) continue;
+      for (j = 0; j < SAMPLES_PER_SEC; j++) {
+	llr_ones[secs[i]][j] += bits[s + j];
+	llr_total[secs[i]][j]++;
+      }
+    }
+    files++;
+  }
+  fclose(fp);
+  engine_invalidate(0);
+
+  if (files == 0) {
+    fprintf(stderr, "Error: no labeled files in %s\n", dir);
+    return -1;
+  }
+
+  if ((fp = fopen(fname, "w")) == NULL) {
+    fprintf(stderr, "Error: could not open file %s for writing\n", fname);
+    return -1;
+  }
+  fprintf(fp, "# symbol position ones samples, SAMP_PERIOD %u, from %u minutes of %s\n", SAMP_PERIOD,
+	  files, dir);
+  for (sym = 0; sym < 3; sym++)
+    for (j = 0; j < SAMPLES_PER_SEC; j++)
+      fprintf(fp, "%u %u %u %u\n", sym, j, llr_ones[sym][j], llr_total[sym][j]);
+  fclose(fp);
+
+  llr_costs();
+  llr_loaded = 1;
+  printf("Learned from %u minutes, wrote %s\n", files, fname);
+  for (sym = 0; sym < 3; sym++) {
+    printf("  %s P(1):", sym == 0 ? "zero" : sym == 1 ? "one " : "mark");
+    for (j = 0; j < SAMPLES_PER_SEC; j++) printf(" %.2f", (double)llr_ones[sym][j]/llr_total[sym][j]);
+    printf("\n");
+  }
+
+  return 0;
+}
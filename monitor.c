@@ -0,0 +1,142 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * System clock monitor.  For each confident decode, the on-time marker is
+ * timestamped against the host wall clock (CLOCK_REALTIME) and the source
+ * clock (CLOCK_MONOTONIC for the GPIO), and the offset of the wall clock from
+ * WWVB is recorded with running statistics: mean, standard deviation, and the
+ * overlapping Allan deviation for averaging times from a minute to hours.
+ *
+ * The marker is only known to lie between two samples, so it is taken as
+ * half a sample period before the first sample of the frame, with an
+ * uncertainty of half a period plus the latest any sample was read in the
+ * capture.  monitor_delay_usec is subtracted for receiver and propagation
+ * delay, which must be calibrated for the site.
+ *
+ * Each offset is printed and appended as a CSV record to the monitor file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "wwvb_dec.h"
+
+/* Offsets kept for the Allan deviation, one slot per minute */
+#define MON_MINUTES 1440
+
+uint32_t monitor_delay_usec;
+
+static FILE *mon_fp;
+
+static struct {
+  uint32_t n;
+  double mean, m2;        /* Welford running mean and sum of squares, seconds */
+} mon;
+
+/* Offset for each minute, ring indexed by minute */
+static double mon_offset[MON_MINUTES];
+static int32_t mon_minute[MON_MINUTES];
+
+/* Averaging times for the Allan deviation, minutes */
+static uint32_t mon_taus[] = {1, 2, 5, 10, 20, 50, 100, 200, 500};
+
+int monitor_open(char *fname)
+{
+  uint32_t i;
+
+  if ((mon_fp = fopen(fname, "a")) == NULL) {
+    fprintf(stderr, "Error: could not open file %s for appending\n", fname);
+    return -1;
+  }
+  fprintf(mon_fp, "# minute, utc, offset_ms, uncertainty_ms, realtime_usec, monotonic_usec, worst_score\n");
+  fflush(mon_fp);
+
+  for (i = 0; i < MON_MINUTES; i++) mon_minute[i] = -1;
+
+  return 0;
+}
+
+int monitor_enabled(void)
+{
+  return mon_fp != NULL;
+}
+
+/* Offset recorded for a minute, if there is one */
+
+static int mon_get(int32_t minute, double *x)
+{
+  uint32_t i = minute % MON_MINUTES;
+
+  if (minute < 0 || mon_minute[i] != minute) return 0;
+  *x = mon_offset[i];
+  return 1;
+}
+
+/* Overlapping Allan deviation at tau minutes from the time error samples of
+ * the last MON_MINUTES minutes ending at minute last.  Only second
+ * differences with all three minutes present are used.  Returns -1 if there
+ * are none. */
+
+static double mon_adev(int32_t last, uint32_t tau)
+{
+  int32_t m;
+  double x0, x1, x2, d, sum = 0;
+  uint32_t n = 0;
+
+  for (m = last - 2*tau; m > last - MON_MINUTES && m >= 0; m--) {
+    if (mon_get(m, &x0) && mon_get(m + tau, &x1) && mon_get(m + 2*tau, &x2)) {
+      d = x2 - 2*x1 + x0;
+      sum += d*d;
+      n++;
+    }
+  }
+  if (n == 0) return -1;
+
+  return sqrt(sum/(2.0*n))/(tau*60.0);
+}
+
+/* Record the decode of minute whose frame starts at sample frame_idx of a
+ * capture whose first sample was at source time first */
+
+void monitor_frame(uint64_t first, uint32_t frame_idx, int32_t minute, uint32_t worst)
+{
+  uint64_t marker, realtime, utc;
+  double offset, unc, delta, adev;
+  uint32_t i, year, daynum, hours, minutes, lyi;
+
+  TRACE_BEGIN("monitor_frame");
+
+  marker = first + frame_idx*(uint64_t)SAMP_PERIOD_USEC - SAMP_PERIOD_USEC/2 - monitor_delay_usec;
+  realtime = fill_realtime(marker);
+  utc = ((uint64_t)minute*60 + EPOCH_2000)*1000000ULL;
+  offset = ((double)realtime - (double)utc)/1e6;
+  unc = (SAMP_PERIOD_USEC/2 + fill_late_max)/1e6;
+
+  mon.n++;
+  delta = offset - mon.mean;
+  mon.mean += delta/mon.n;
+  mon.m2 += delta*(offset - mon.mean);
+
+  mon_offset[minute % MON_MINUTES] = offset;
+  mon_minute[minute % MON_MINUTES] = minute;
+
+  minute_to_fields(minute, &year, &daynum, &hours, &minutes, &lyi);
+
+  printf("  Monitor: system clock %+.1f ms +/- %.1f ms from WWVB, mean %+.1f ms, stddev %.1f ms (%u)\n",
+	 offset*1e3, unc*1e3, mon.mean*1e3, mon.n > 1 ? sqrt(mon.m2/(mon.n - 1))*1e3 : 0.0, mon.n);
+  printf("  Monitor ADEV:");
+  for (i = 0; i < sizeof(mon_taus)/sizeof(mon_taus[0]); i++) {
+    if ((adev = mon_adev(minute, mon_taus[i])) >= 0)
+      printf(" %um %.1e", mon_taus[i], adev);
+  }
+  printf("\n");
+
+  fprintf(mon_fp, "%d, 20%02u-%03u %02u:%02u, %.3f, %.3f, %llu, %llu, %u\n", minute, year, daynum,
+	  hours, minutes, offset*1e3, unc*1e3, (unsigned long long)realtime,
+	  (unsigned long long)marker, worst);
+  fflush(mon_fp);
+
+  TRACE_END("monitor_frame");
+}
@@ -0,0 +1,167 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Optional per-stage instrumentation of the decoder.  Wall time and, where
+ * the kernel and CPU allow it, hardware counters from perf_event_open() are
+ * accumulated around find_frame() and decode_frame() and reported after each
+ * decode.  xor_frame() and decode_sec() are far too short to bracket with
+ * counter reads, so their cost is reported as the average over the calls made
+ * by the enclosing stage.
+ *
+ * Counters are opened one by one so a CPU lacking one (or a kernel that does
+ * not permit them, see /proc/sys/kernel/perf_event_paranoid) only loses that
+ * column.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "wwvb_dec.h"
+
+#define PERF_NUM_COUNTERS 4
+#define PERF_NUM_STAGES 2
+
+__thread int perf_enabled;
+
+static struct {
+  char *name;
+  uint32_t type;
+  uint64_t config;
+  int fd;
+} counters[PERF_NUM_COUNTERS] = {
+#ifdef __linux__
+  {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1},
+  {"instr", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1},
+  {"cache-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1},
+  {"branch-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1}
+#else
+  {"cycles", 0, 0, -1},
+  {"instr", 0, 0, -1},
+  {"cache-miss", 0, 0, -1},
+  {"branch-miss", 0, 0, -1}
+#endif
+};
+
+static struct {
+  char *name;
+  char *inner_name;
+  uint64_t start_usec;
+  uint64_t start[PERF_NUM_COUNTERS];
+  uint64_t usec;
+  uint64_t count[PERF_NUM_COUNTERS];
+  uint64_t inner_calls;
+} stages[PERF_NUM_STAGES] = {
+  {"find_frame", "xor_frame"},
+  {"decode_frame", "decode_sec"}
+};
+
+static uint64_t perf_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+}
+
+static uint64_t perf_read(uint32_t i)
+{
+  uint64_t val;
+
+  if (counters[i].fd < 0 || read(counters[i].fd, &val, sizeof(val)) != sizeof(val)) return 0;
+  return val;
+}
+
+/* Open the counters for this thread, user space only */
+
+void perf_init(void)
+{
+  uint32_t i;
+#ifdef __linux__
+  struct perf_event_attr attr;
+
+  for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counters[i].type;
+    attr.config = counters[i].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    counters[i].fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (counters[i].fd < 0)
+      fprintf(stderr, "Warning: perf counter %s unavailable: %s\n", counters[i].name,
+	      strerror(errno));
+  }
+#else
+  for (i = 0; i < PERF_NUM_COUNTERS; i++)
+    fprintf(stderr, "Warning: perf counter %s unavailable on this OS\n", counters[i].name);
+#endif
+
+  perf_enabled = 1;
+}
+
+void perf_begin(uint32_t stage)
+{
+  uint32_t i;
+
+  for (i = 0; i < PERF_NUM_COUNTERS; i++) stages[stage].start[i] = perf_read(i);
+  stages[stage].start_usec = perf_usec();
+}
+
+void perf_end(uint32_t stage, uint32_t inner_calls)
+{
+  uint32_t i;
+
+  stages[stage].usec += perf_usec() - stages[stage].start_usec;
+  for (i = 0; i < PERF_NUM_COUNTERS; i++)
+    stages[stage].count[i] += perf_read(i) - stages[stage].start[i];
+  stages[stage].inner_calls += inner_calls;
+}
+
+static void perf_print_row(char *name, double usec, uint64_t *count, double div)
+{
+  uint32_t i;
+
+  printf("    %-14s %10.*f", name, div == 1 ? 0 : 2, usec/div);
+  for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+    if (counters[i].fd < 0)
+      printf(" %11s", "-");
+    else
+      printf(" %11.*f", div == 1 ? 0 : 2, count[i]/div);
+  }
+  if (counters[0].fd >= 0 && counters[1].fd >= 0 && count[0] > 0)
+    printf(" %5.2f", count[1]/(double)count[0]);
+  printf("\n");
+}
+
+/* Print the stages since the last report, then start over */
+
+void perf_report(void)
+{
+  uint32_t i;
+  char name[32];
+
+  printf("    %-14s %10s", "Stage", "usec");
+  for (i = 0; i < PERF_NUM_COUNTERS; i++) printf(" %11s", counters[i].name);
+  printf(" %5s\n", "IPC");
+
+  for (i = 0; i < PERF_NUM_STAGES; i++) {
+    perf_print_row(stages[i].name, stages[i].usec, stages[i].count, 1);
+    if (stages[i].inner_calls > 0) {
+      snprintf(name, sizeof(name), " /%s", stages[i].inner_name);
+      perf_print_row(name, stages[i].usec, stages[i].count, stages[i].inner_calls);
+    }
+    memset(stages[i].count, 0, sizeof(stages[i].count));
+    stages[i].usec = 0;
+    stages[i].inner_calls = 0;
+  }
+  printf("\n");
+}
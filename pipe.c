@@ -0,0 +1,207 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Pipelined continuous decoding.  An acquisition thread samples without a
+ * break, one minute to a buffer, and hands the buffers to the decode thread
+ * through a lock-free single producer, single consumer queue.  The decode
+ * thread keeps the last two minutes in bits[] and searches only the first
+ * minute of them for the frame start, so every frame is decoded exactly once,
+ * and searching, decoding, printing and saving never hold up sampling.
+ *
+ * If the decoder falls so far behind that the queue is full, the acquisition
+ * thread keeps sampling on time into a scratch buffer and that minute is
+ * dropped, rather than sampling late.  A source on a virtual clock (the
+ * simulator) is never late, so it waits for the decoder instead.
+ *
+ * Shadow engines (-X, see shadow.c) decode each minute alongside.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "wwvb_dec.h"
+
+#define PIPE_BUFS 4
+#define PIPE_CHUNK (60*SAMPLES_PER_SEC)
+
+/* Decode thread poll interval when the queue is empty, usec */
+#define PIPE_POLL_USEC 10000
+
+typedef struct {
+  uint32_t seq;           /* minutes since the pipeline started */
+  uint32_t late_max;      /* latest a sample was read, usec */
+  uint8_t bits[PIPE_CHUNK];
+} pipe_buf_t;
+
+static pipe_buf_t pipe_bufs[PIPE_BUFS];
+static pipe_buf_t pipe_scratch;
+static _Atomic uint32_t pipe_head, pipe_tail;   /* buffers ever pushed, popped */
+static _Atomic int pipe_done;
+static _Atomic uint32_t pipe_overruns;
+
+static source_t *pipe_src;
+static uint64_t pipe_first;
+
+static void *pipe_acquire(void *arg)
+{
+  source_t *src = pipe_src;
+  pipe_buf_t *b;
+  uint64_t due, now;
+  uint32_t seq, i, head;
+
+  trace_thread_name("acquire");
+
+  for (seq = 0; !atomic_load(&pipe_done) && !wwvb_stop; seq++) {
+
+    head = atomic_load_explicit(&pipe_head, memory_order_relaxed);
+    due = pipe_first + (uint64_t)seq*PIPE_CHUNK*SAMP_PERIOD_USEC;
+
+    TRACE_BEGIN("queue_wait");
+    while (head - atomic_load_explicit(&pipe_tail, memory_order_acquire) == PIPE_BUFS &&
+	   src->now() <= due && !atomic_load(&pipe_done))
+      sched_yield();
+    TRACE_END("queue_wait");
+    if (atomic_load(&pipe_done)) break;
+
+    if (head - atomic_load_explicit(&pipe_tail, memory_order_acquire) < PIPE_BUFS) {
+      b = &pipe_bufs[head % PIPE_BUFS];
+    } else {
+      b = &pipe_scratch;
+      atomic_fetch_add(&pipe_overruns, 1);
+    }
+    b->seq = seq;
+    b->late_max = 0;
+
+    TRACE_BEGIN("sample");
+    for (i = 0; i < PIPE_CHUNK && !wwvb_stop && !atomic_load_explicit(&pipe_done, memory_order_relaxed); i++) {
+      due = pipe_first + ((uint64_t)seq*PIPE_CHUNK + i)*SAMP_PERIOD_USEC;
+      src->wait_until(due);
+      b->bits[i] = src->read();
+      if (i % SAMPLES_PER_SEC == 0 && (now = src->now()) - due > b->late_max)
+	b->late_max = now - due;
+    }
+    TRACE_END("sample");
+
+    if (b != &pipe_scratch && i == PIPE_CHUNK)
+      atomic_store_explicit(&pipe_head, head + 1, memory_order_release);
+  }
+
+  return NULL;
+}
+
+/* Take the next minute of samples from the queue into the second half of
+ * bits[], after moving the minute before it to the first half.  Returns its
+ * sequence number, or -1 on stop. */
+
+static int64_t pipe_pop(uint32_t *late_max)
+{
+  struct timespec ts = {0, PIPE_POLL_USEC*1000};
+  uint32_t tail;
+  pipe_buf_t *b;
+  int64_t seq;
+
+  tail = atomic_load_explicit(&pipe_tail, memory_order_relaxed);
+
+  TRACE_BEGIN("queue_wait");
+  while (atomic_load_explicit(&pipe_head, memory_order_acquire) == tail && !wwvb_stop)
+    nanosleep(&ts, NULL);
+  TRACE_END("queue_wait");
+  if (wwvb_stop) return -1;
+
+  b = &pipe_bufs[tail % PIPE_BUFS];
+  memmove(bits, bits + PIPE_CHUNK, PIPE_CHUNK);
+  memcpy(bits + PIPE_CHUNK, b->bits, PIPE_CHUNK);
+  engine_invalidate(0);
+  seq = b->seq;
+  *late_max = b->late_max;
+
+  atomic_store_explicit(&pipe_tail, tail + 1, memory_order_release);
+
+  return seq;
+}
+
+/* Decode every minute, count times (forever if 0), with sampling in its own
+ * thread.  The samples of each decode are saved to outfilename if it is not
+ * NULL. */
+
+int pipe_run(source_t *src, uint32_t count, int print_flag, char *outfilename)
+{
+  pthread_t thread;
+  int64_t seq, last_seq = -2;
+  uint32_t n = 0, frame_idx, min_val, score, late_max, overruns = 0;
+  uint64_t local, nsec = 0;
+  int32_t minute;
+
+  if (shadow_start() < 0) return -1;
+  if (control_start() < 0) {
+    shadow_stop();
+    return -1;
+  }
+  pipe_src = src;
+  pipe_first = src->now();
+
+  if (pthread_create(&thread, NULL, pipe_acquire, NULL) != 0) {
+    fprintf(stderr, "Error: could not start acquisition thread\n");
+    shadow_stop();
+    return -1;
+  }
+  trace_thread_name("decode");
+
+  while ((count == 0 || n < count) && (seq = pipe_pop(&late_max)) >= 0) {
+
+    /* A whole minute before this one is needed, so after a dropped minute
+     * wait for the next */
+    if (seq != last_seq + 1) {
+      if (last_seq >= 0)
+	fprintf(stderr, "Warning: decoder fell behind, %u minute(s) of samples dropped\n",
+		(uint32_t)(seq - last_seq - 1));
+      last_seq = seq;
+      continue;
+    }
+    last_seq = seq;
+
+    /* Frame starts in the first minute, so each frame is found just once */
+    shadow_begin();
+    if (shadow_enabled()) nsec = shadow_cpu_nsec();
+    frame_idx = find_frame(BLEN, &min_val);
+    printf("\nFound frame at sample %u, score %u, minute %u of pipeline, latest sample %u usec\n",
+	   frame_idx, score_errors(min_val), (uint32_t)seq, late_max);
+
+    if (print_flag) print_frame(frame_idx);
+
+    score = decode_frame(frame_idx);
+    if (shadow_enabled()) nsec = shadow_cpu_nsec() - nsec;
+    print_decode(score);
+    if (perf_enabled) perf_report();
+    shadow_end(frame_idx, nsec);
+
+    local = pipe_first + ((uint64_t)(seq - 1)*PIPE_CHUNK + frame_idx)*SAMP_PERIOD_USEC;
+    control_decode(seq, local, frame_idx, min_val, score, late_max,
+		   atomic_load(&pipe_overruns) - overruns);
+    overruns = atomic_load(&pipe_overruns);
+
+    minute = frame_minute();
+    if (frame_worst_score() < verdict_ok*engine->one && minute >= 0) {
+      flywheel_update(local, minute);
+      flywheel_print(pipe_first + (uint64_t)(seq + 1)*PIPE_CHUNK*SAMP_PERIOD_USEC);
+    }
+
+    if (outfilename != NULL) save_buffer_file(outfilename);
+    n++;
+  }
+
+  atomic_store(&pipe_done, 1);
+  pthread_join(thread, NULL);
+  shadow_stop();
+
+  overruns = atomic_load(&pipe_overruns);
+  if (overruns > 0) printf("  Pipeline: %u minute(s) dropped by decoder overrun\n", overruns);
+
+  return 0;
+}
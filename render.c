@@ -0,0 +1,131 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Diagnostic display of sampled bits, one line per second, each annotated with
+ * the symbol decode_sec() makes of it and its score.  Lines are formatted into
+ * a buffer and written with a single write(), rather than a printf() per
+ * sample, which is slow over SSH on a Pi Zero.
+ *
+ * The live view prints each second as soon as its samples have arrived.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wwvb_dec.h"
+
+/* "   000 (0000): " + samples + "  M 40\n" */
+#define ROW_LEN (16 + SAMPLES_PER_SEC + 8)
+#define HEADER_LEN 160
+
+int live_enabled;
+
+static int32_t live_frame_idx;
+static uint32_t live_edges[SAMPLES_PER_SEC];
+
+static void write_all(char *buf, uint32_t len)
+{
+  ssize_t n;
+
+  fflush(stdout);
+  while (len > 0) {
+    if ((n = write(STDOUT_FILENO, buf, len)) <= 0) return;
+    buf += n;
+    len -= n;
+  }
+}
+
+/* Format the second starting at samp_idx.  sec is the second within the frame,
+ * or -1 if not known. */
+
+static uint32_t render_row(char *buf, uint32_t samp_idx, int32_t sec)
+{
+  char *p = buf;
+  uint32_t j, sym, score;
+
+  if (sec >= 0)
+    p += sprintf(p, "   %03d (%04u): ", sec, samp_idx);
+  else
+    p += sprintf(p, "   --- (%04u): ", samp_idx);
+
+  for (j = 0; j < SAMPLES_PER_SEC; j++) *p++ = '0' + bits[samp_idx + j];
+
+  sym = decode_sec(samp_idx, &score);
+  p += sprintf(p, "  %c %2u\n", "01M"[sym], score_errors(score));
+
+  return p - buf;
+}
+
+static uint32_t render_header(char *buf)
+{
+  return sprintf(buf, "   Sec Sample          Samples in Second            Sym Score\n"
+		 "   --- ------  ----------------------------------------  --- -----\n");
+}
+
+/* Display the frame with sampled bits organized by seconds within the frame.  If
+ * the decode is correct, the first second will be a marker.  If the decode is
+ * correct, you can see the values of each second by eye.
+ *
+ * A marker is 80% zeros followed by 20% ones.
+ * A zero is 20% zeros followed by 80% ones.
+ * A one is 50% zeros followed by 50% ones.
+ *
+ * Note some people may use an inverted definition.
+ */
+
+void print_frame(uint32_t samp_idx)
+{
+  static char buf[HEADER_LEN + 60*ROW_LEN];
+  uint32_t len, secs;
+
+  TRACE_BEGIN("print_frame");
+  len = render_header(buf);
+  for (secs = 0; secs < 60; secs++)
+    len += render_row(buf + len, samp_idx + secs*SAMPLES_PER_SEC, secs);
+  write_all(buf, len);
+  TRACE_END("print_frame");
+}
+
+/* Start the live view of a capture.  frame_idx is the sample the frame is
+ * expected to start at, or -1 if not known, in which case seconds are lined
+ * up on the most common position of falling edges seen so far. */
+
+void live_start(int32_t frame_idx)
+{
+  char buf[HEADER_LEN];
+
+  live_frame_idx = frame_idx;
+  memset(live_edges, 0, sizeof(live_edges));
+  write_all(buf, render_header(buf));
+}
+
+/* Called by fill_buffer() after sample i has been stored */
+
+void live_sample(uint32_t i)
+{
+  char buf[ROW_LEN];
+  uint32_t j, phase, start, frame_len = 60*SAMPLES_PER_SEC;
+  int32_t sec = -1;
+
+  if (i > 0 && bits[i - 1] == 1 && bits[i] == 0) live_edges[i % SAMPLES_PER_SEC]++;
+
+  if (live_frame_idx >= 0) {
+    phase = live_frame_idx % SAMPLES_PER_SEC;
+  } else {
+    phase = 0;
+    for (j = 1; j < SAMPLES_PER_SEC; j++)
+      if (live_edges[j] > live_edges[phase]) phase = j;
+  }
+
+  if (i + 1 < SAMPLES_PER_SEC || (i + 1) % SAMPLES_PER_SEC != phase) return;
+
+  start = i + 1 - SAMPLES_PER_SEC;
+  if (live_frame_idx >= 0)
+    sec = ((start + frame_len - live_frame_idx % frame_len) % frame_len)/SAMPLES_PER_SEC;
+
+  TRACE_BEGIN("live_row");
+  write_all(buf, render_row(buf, start, sec));
+  TRACE_END("live_row");
+}
@@ -0,0 +1,414 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Duty cycled reception.  After a confident decode the receiver is powered
+ * down through its PDN pin and nothing is sampled for the requested interval.
+ * The receiver is then woken just in time to capture the one frame whose start
+ * is predicted from the last decode, and the frame is only searched for near
+ * that prediction.  If the frame does not verify, go back to a full capture.
+ *
+ * Confident decodes feed the flywheel, which serves time in between, and the
+ * system clock monitor.
+ *
+ * Optionally, a history of decode results by hour of day (UTC) is kept across
+ * runs, and attempts are deferred out of hours where decodes usually fail,
+ * though never more than refresh_sec apart.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "wwvb_dec.h"
+
+/* Receiver settle time after PDN is released */
+#define PDN_WARMUP_SEC 5
+
+/* Search this far either side of the predicted frame start, plus DRIFT_PPM of
+ * the time since the last lock for local clock error */
+#define LOCK_MARGIN_USEC 250000
+#define DRIFT_PPM 100
+
+/* Rough power draws for the energy proxy */
+#define RX_ON_MW 1
+#define CPU_SPIN_MW 400
+
+#define USEC_PER_MIN 60000000ULL
+#define USEC_PER_HOUR 3600000000ULL
+
+/* An hour is good for decoding if an optimistic estimate of its success
+ * probability is at least this fraction of the best hour's.  The optimism
+ * shrinks with attempts, so hours with little history still get tried, and
+ * at most doubles the estimate, so a run of failures makes an hour bad. */
+#define HIST_GOOD_FRAC 0.8
+
+/* Default for -R, secs */
+#define REFRESH_SEC 21600
+
+static struct {
+  uint64_t start;     /* source time sched_run() started */
+  uint64_t rx_on;     /* usec receiver was powered, up to rx_on_since */
+  uint64_t rx_on_since;
+  int rx_powered;
+  uint64_t sampling;  /* usec spent in fill_buffer() */
+  uint64_t samples;
+  uint32_t decodes, verified;
+} duty;
+
+/* Decode history by UTC hour of day */
+
+static struct {
+  uint32_t attempts;
+  uint32_t successes;
+  uint32_t score_sum;   /* sum of worst per-second scores */
+} hist[24];
+
+static char *hist_fname;
+
+/* Longest time between decode attempts when deferring to good hours, 0 for
+ * no limit */
+uint32_t refresh_sec = REFRESH_SEC;
+
+/* Print flywheel time this often while idle, 0 for never */
+uint32_t flywheel_print_sec;
+
+/* Load the history file, if it exists yet.  Results are saved back to it
+ * after every attempt. */
+
+int hist_load(char *fname)
+{
+  FILE *fp;
+  char line[128];
+  uint32_t h, a, s, sum;
+
+  hist_fname = fname;
+  if ((fp = fopen(fname, "r")) == NULL) return 0;
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == '#') continue;
+    if (sscanf(line, "%u %u %u %u", &h, &a, &s, &sum) != 4 || h > 23 || s > a) {
+      fprintf(stderr, "Error: bad line in history file %s: %s", fname, line);
+      fclose(fp);
+      return -1;
+    }
+    hist[h].attempts = a;
+    hist[h].successes = s;
+    hist[h].score_sum = sum;
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+static void hist_save(void)
+{
+  FILE *fp;
+  uint32_t h;
+
+  if ((fp = fopen(hist_fname, "w")) == NULL) {
+    fprintf(stderr, "Warning: could not open file %s for writing\n", hist_fname);
+    return;
+  }
+
+  TRACE_BEGIN("hist_save");
+  fprintf(fp, "# hour attempts successes score_sum\n");
+  for (h = 0; h < 24; h++)
+    fprintf(fp, "%u %u %u %u\n", h, hist[h].attempts, hist[h].successes, hist[h].score_sum);
+  fclose(fp);
+  TRACE_END("hist_save");
+}
+
+/* Estimated probability a decode attempt in hour h succeeds.  Hours without
+ * history start at 1/2. */
+
+static double hist_prob(uint32_t h)
+{
+  return (hist[h].successes + 1)/(double)(hist[h].attempts + 2);
+}
+
+static int hist_good(uint32_t h)
+{
+  uint32_t i;
+  double best = 0, bonus;
+
+  for (i = 0; i < 24; i++)
+    if (hist_prob(i) > best) best = hist_prob(i);
+
+  bonus = 1/sqrt(hist[h].attempts + 2);
+  if (bonus > hist_prob(h)) bonus = hist_prob(h);
+
+  return hist_prob(h) + bonus >= HIST_GOOD_FRAC*best;
+}
+
+/* The last confident decode, used to tell UTC when not locked */
+static int have_ref;
+static int32_t ref_minute;
+static uint64_t ref_start;
+
+/* UTC, in usec since the Unix epoch, at source time t.  From the last
+ * confident decode if there was one, else from the host clock. */
+
+static uint64_t utc_at(source_t *src, uint64_t t)
+{
+  if (have_ref)
+    return ((uint64_t)ref_minute*60 + EPOCH_2000)*1000000ULL + (t - ref_start);
+
+  return src->realtime() + (t - src->now());
+}
+
+/* Defer an attempt planned at source time wake to the start of the next good
+ * hour, but not past limit */
+
+static uint64_t hist_defer(source_t *src, uint64_t wake, uint64_t limit)
+{
+  uint64_t utc;
+  uint32_t i;
+
+  utc = utc_at(src, wake);
+  for (i = 0; i < 24; i++) {
+    if (hist_good((utc/USEC_PER_HOUR + i) % 24)) {
+      if (i > 0) wake += (utc/USEC_PER_HOUR + i)*USEC_PER_HOUR - utc;
+      break;
+    }
+  }
+
+  return wake < limit ? wake : limit;
+}
+
+static void rx_power(source_t *src, int on)
+{
+  uint64_t now = src->now();
+
+  if (on == duty.rx_powered) return;
+  if (on)
+    duty.rx_on_since = now;
+  else
+    duty.rx_on += now - duty.rx_on_since;
+  src->power(on);
+  duty.rx_powered = on;
+}
+
+/* Capture len samples, the first keep of them carried over from the last
+ * capture with the first at source time first.  Returns the source time of the
+ * first sample. */
+
+static uint64_t capture(source_t *src, uint32_t keep, uint32_t len, uint64_t first)
+{
+  uint64_t t;
+
+  t = src->now();
+  if (keep == 0) first = t;
+  fill_late_max = 0;
+  fill_buffer_from(src, keep, len, first);
+  duty.sampling += src->now() - t;
+  duty.samples += len - keep;
+
+  return first;
+}
+
+/* Capture until a confident frame is found, see fill_buffer_adaptive() */
+
+static uint64_t capture_adaptive(source_t *src, uint32_t *len, uint32_t *frame_idx,
+				 uint32_t *min_val)
+{
+  uint64_t t, first;
+
+  t = src->now();
+  first = fill_buffer_adaptive(src, len, frame_idx, min_val);
+  duty.sampling += src->now() - t;
+  duty.samples += (src->now() - t)/SAMP_PERIOD_USEC;
+
+  return first;
+}
+
+/* Sleep, printing flywheel time every flywheel_print_sec */
+
+static void idle(source_t *src, uint64_t usec)
+{
+  uint64_t chunk, end = src->now() + usec;
+
+  TRACE_BEGIN("sleep");
+  while (usec > 0 && !wwvb_stop) {
+    chunk = usec;
+    if (flywheel_print_sec > 0 && chunk > flywheel_print_sec*1000000ULL)
+      chunk = flywheel_print_sec*1000000ULL;
+    src->sleep(chunk);
+    usec -= chunk;
+    if (flywheel_print_sec > 0 && usec > 0) flywheel_print(src->now());
+  }
+  if (src->now() < end) src->wait_until(end);
+  TRACE_END("sleep");
+}
+
+/* Sleep to a source time, busy waiting only the last few ms */
+
+static void sleep_until(source_t *src, uint64_t t)
+{
+  uint64_t now = src->now();
+
+  if (t > now + 20000) idle(src, t - now - 20000);
+  src->wait_until(t);
+}
+
+/* Sleep to a source time with the receiver powered down, if there is time
+ * for it to settle after powering up again */
+
+static void sleep_powered_down(source_t *src, uint64_t t)
+{
+  uint64_t now = src->now();
+
+  if (t > now + PDN_WARMUP_SEC*1000000ULL) {
+    rx_power(src, 0);
+    idle(src, t - now - PDN_WARMUP_SEC*1000000ULL);
+    rx_power(src, 1);
+  }
+  sleep_until(src, t);
+}
+
+static void print_duty(source_t *src)
+{
+  uint64_t now, elapsed, rx_on;
+  double energy;
+
+  now = src->now();
+  elapsed = now - duty.start;
+  rx_on = duty.rx_on + (duty.rx_powered ? now - duty.rx_on_since : 0);
+  if (elapsed == 0) elapsed = 1;
+
+  /* mW * usec / 1e9 = J */
+  energy = (rx_on*(double)RX_ON_MW + duty.sampling*(double)CPU_SPIN_MW)/1e9;
+
+  printf("  Duty: %u decodes, %u verified, receiver on %.1f%%, sampling %.1f%% (%llu samples)\n",
+	 duty.decodes, duty.verified, 100.0*rx_on/elapsed, 100.0*duty.sampling/elapsed,
+	 (unsigned long long)duty.samples);
+  printf("  Energy: ~%.1f J over %.0f s, %.2f mW average\n", energy, elapsed/1e6,
+	 energy*1e9/elapsed);
+}
+
+/* Decode repeatedly, count times (forever if 0), sleeping interval_sec with the
+ * receiver powered down between confident decodes. */
+
+void sched_run(source_t *src, uint32_t interval_sec, uint32_t count, int print_flag)
+{
+  int locked = 0, ok;
+  int32_t minute;
+  uint64_t first = 0, next = 0, wake, margin = 0, now;
+  uint32_t len = 0, keep, shift, frame_idx, min_val, score, worst, n, k = 0, hour;
+
+  duty.start = src->now();
+  rx_power(src, 1);
+  wake = duty.start;
+
+  for (n = 0; (count == 0 || n < count) && !wwvb_stop; n++) {
+
+    keep = 0;
+
+    if (!locked) {
+
+      sleep_powered_down(src, wake);
+      if (live_enabled) live_start(-1);
+      if (early_enabled) early_start(-1);
+      first = capture_adaptive(src, &len, &frame_idx, &min_val);
+
+    } else {
+
+      /* First predicted frame start that leaves the search margin after wake,
+       * and time for the receiver to settle if it is powered down */
+      now = src->now();
+      k = 1;
+      next = ref_start + USEC_PER_MIN;
+      margin = LOCK_MARGIN_USEC + USEC_PER_MIN/1000000*DRIFT_PPM;
+      shift = (next - margin - first)/SAMP_PERIOD_USEC;
+
+      if (wake <= now && next - margin < now && shift < len) {
+
+	/* The next frame's window started during the last capture, which
+	 * ended with the frame just decoded.  Carry its tail over rather
+	 * than skip a minute. */
+	keep = len - shift;
+	memmove(bits, bits + shift, keep);
+	engine_invalidate(0);
+	first += (uint64_t)shift*SAMP_PERIOD_USEC;
+	margin = next - first;
+
+      } else {
+
+	k = (wake + LOCK_MARGIN_USEC - ref_start + USEC_PER_MIN - 1)/USEC_PER_MIN;
+	next = ref_start + k*USEC_PER_MIN;
+	margin = LOCK_MARGIN_USEC + (next - ref_start)/1000000*DRIFT_PPM;
+	if (next - margin < now) margin = next - now;
+	sleep_powered_down(src, next - margin);
+      }
+
+      len = 60*SAMPLES_PER_SEC + 2*(margin/SAMP_PERIOD_USEC) + 1;
+      if (live_enabled) live_start(margin/SAMP_PERIOD_USEC);
+      if (early_enabled) early_start(margin/SAMP_PERIOD_USEC);
+      first = capture(src, keep, len, first);
+    }
+
+    if (wwvb_stop) break;
+    if (locked) frame_idx = find_frame(len, &min_val);
+    printf("\nFound frame at sample %u, score %u, capture %u samples\n", frame_idx, score_errors(min_val), len);
+
+    if (print_flag) print_frame(frame_idx);
+
+    score = decode_frame(frame_idx);
+    print_decode(score);
+    if (perf_enabled) perf_report();
+    duty.decodes++;
+
+    worst = frame_worst_score();
+    minute = frame_minute();
+    ok = worst < verdict_ok*engine->one && minute >= 0;
+
+    if (locked) {
+      if (ok && minute == ref_minute + (int32_t)k) {
+	duty.verified++;
+	printf("  Verified: frame %+.0f ms from prediction, lock kept\n",
+	       ((double)(first + frame_idx*(uint64_t)SAMP_PERIOD_USEC) - (double)next)/1000);
+      } else {
+	printf("  Verify failed, re-acquiring\n");
+	locked = 0;
+	ok = 0;
+      }
+    } else if (ok) {
+      locked = 1;
+    }
+
+    /* The hour is taken before updating the reference, so a wrong decode
+     * cannot credit the wrong hour */
+    hour = utc_at(src, first + frame_idx*(uint64_t)SAMP_PERIOD_USEC)/USEC_PER_HOUR % 24;
+
+    if (ok) {
+      have_ref = 1;
+      ref_minute = minute;
+      ref_start = first + frame_idx*(uint64_t)SAMP_PERIOD_USEC;
+      flywheel_update(ref_start, ref_minute);
+      flywheel_print(src->now());
+      if (monitor_enabled()) monitor_frame(first, frame_idx, minute, score_errors(worst));
+    }
+
+    /* Retry at once after a failure */
+    now = src->now();
+    wake = ok ? now + interval_sec*1000000ULL : now;
+
+    if (hist_fname != NULL) {
+      hist[hour].attempts++;
+      hist[hour].successes += ok;
+      hist[hour].score_sum += score_errors(worst);
+      hist_save();
+
+      wake = hist_defer(src, wake, refresh_sec ? now + refresh_sec*1000000ULL : (uint64_t)-1);
+      printf("  History: hour %02u %u/%u decoded (p %.2f), next attempt in %.0f s at hour %02u\n",
+	     hour, hist[hour].successes, hist[hour].attempts, hist_prob(hour), (wake - now)/1e6,
+	     (uint32_t)(utc_at(src, wake)/USEC_PER_HOUR % 24));
+    }
+
+    print_duty(src);
+    fflush(stdout);
+  }
+
+  rx_power(src, 1);
+}
@@ -0,0 +1,245 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Shadow decoding.  With -C, option -X engine[,engine...] runs each of the
+ * given engines as a shadow of the primary (-e) on the same samples.  The
+ * primary alone drives the output, flywheel, monitor and control socket; each
+ * shadow has its own thread, free to run on another core, that searches and
+ * decodes bits[] while the primary does, and the decode thread waits for all
+ * of them before the next minute changes bits[].  frame[], engine and the
+ * perf counters are per thread, so nothing else is shared, and bits[] is
+ * only read.  The queue between sampling and decoding absorbs a slow shadow.
+ *
+ * Each minute prints a line per shadow: its frame start, worst second and
+ * time, and whether it agrees with the primary (same time, or both without
+ * one) and is as confident (both or neither under the -v verdict).  On exit each
+ * engine's disagreements, confidence differences, mean worst second and CPU
+ * time per decode are summarized.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "wwvb_dec.h"
+
+#define SHADOW_MAX 4
+
+typedef struct {
+  engine_t *engine;
+  pthread_t thread;
+
+  /* This minute's decode, valid when done is set */
+  uint32_t frame_idx, worst;
+  int32_t minute;
+  uint64_t nsec;
+
+  /* Totals */
+  uint32_t decodes, disagree, confident_only, primary_only;
+  uint64_t worst_sum, nsec_sum;
+} shadow_t;
+
+static shadow_t shadows[SHADOW_MAX];
+static uint32_t shadow_n;
+
+/* The decode thread raises shadow_gen to start a minute, and each shadow
+ * raises shadow_done when it has finished with bits[] */
+static pthread_mutex_t shadow_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shadow_go = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t shadow_fin = PTHREAD_COND_INITIALIZER;
+static uint32_t shadow_gen, shadow_done;
+static int shadow_quit;
+
+/* Primary totals */
+static uint32_t shadow_decodes;
+static uint64_t shadow_worst_sum, shadow_nsec_sum;
+
+uint64_t shadow_cpu_nsec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/* Add the engines in a comma separated list.  Returns -1 if one is unknown,
+ * the primary, or given twice. */
+
+int shadow_add(char *names)
+{
+  char *name, *save;
+  engine_t *e;
+  uint32_t i;
+
+  for (name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+    if ((e = engine_find(name)) == NULL) {
+      fprintf(stderr, "Error: no engine %s for -X\n", name);
+      return -1;
+    }
+    for (i = 0; i < shadow_n; i++) {
+      if (shadows[i].engine == e) {
+	fprintf(stderr, "Error: engine %s given twice to -X\n", name);
+	return -1;
+      }
+    }
+    if (shadow_n == SHADOW_MAX) {
+      fprintf(stderr, "Error: at most %u shadow engines\n", SHADOW_MAX);
+      return -1;
+    }
+    shadows[shadow_n++].engine = e;
+  }
+
+  return 0;
+}
+
+int shadow_enabled(void)
+{
+  return shadow_n > 0;
+}
+
+static void *shadow_run(void *arg)
+{
+  shadow_t *s = arg;
+  uint32_t gen = 0, min_val;
+  uint64_t t;
+
+  engine = s->engine;
+  trace_thread_name(s->engine->name);
+
+  for (;;) {
+    pthread_mutex_lock(&shadow_lock);
+    while (shadow_gen == gen && !shadow_quit) pthread_cond_wait(&shadow_go, &shadow_lock);
+    gen = shadow_gen;
+    pthread_mutex_unlock(&shadow_lock);
+    if (shadow_quit) break;
+
+    t = shadow_cpu_nsec();
+    s->frame_idx = find_frame(BLEN, &min_val);
+    decode_frame(s->frame_idx);
+    s->nsec = shadow_cpu_nsec() - t;
+    s->worst = frame_worst_score();
+    s->minute = frame_minute();
+
+    pthread_mutex_lock(&shadow_lock);
+    shadow_done++;
+    pthread_cond_signal(&shadow_fin);
+    pthread_mutex_unlock(&shadow_lock);
+  }
+
+  return NULL;
+}
+
+/* Start the shadow threads.  The primary engine may not also be a shadow. */
+
+int shadow_start(void)
+{
+  uint32_t i;
+
+  for (i = 0; i < shadow_n; i++) {
+    if (shadows[i].engine == engine) {
+      fprintf(stderr, "Error: engine %s is the primary, it can not also be a shadow\n", engine->name);
+      return -1;
+    }
+  }
+  for (i = 0; i < shadow_n; i++) {
+    if (pthread_create(&shadows[i].thread, NULL, shadow_run, &shadows[i]) != 0) {
+      fprintf(stderr, "Error: could not start shadow thread\n");
+      shadow_n = i;
+      shadow_stop();
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Start the shadows on the samples now in bits[] */
+
+void shadow_begin(void)
+{
+  if (shadow_n == 0) return;
+
+  pthread_mutex_lock(&shadow_lock);
+  shadow_done = 0;
+  shadow_gen++;
+  pthread_cond_broadcast(&shadow_go);
+  pthread_mutex_unlock(&shadow_lock);
+}
+
+/* Wait for the shadows to finish with bits[] and compare them with the
+ * primary's decode, in frame[], of the frame at frame_idx, which took nsec of
+ * CPU */
+
+void shadow_end(uint32_t frame_idx, uint64_t nsec)
+{
+  uint32_t i, worst = frame_worst_score(), year, daynum, hours, minutes, lyi;
+  int32_t minute = frame_minute();
+  int ok = worst < verdict_ok*engine->one && minute >= 0, s_ok, agree;
+  shadow_t *s;
+
+  if (shadow_n == 0) return;
+
+  pthread_mutex_lock(&shadow_lock);
+  while (shadow_done < shadow_n) pthread_cond_wait(&shadow_fin, &shadow_lock);
+  pthread_mutex_unlock(&shadow_lock);
+
+  shadow_decodes++;
+  shadow_worst_sum += score_errors(worst);
+  shadow_nsec_sum += nsec;
+
+  for (i = 0; i < shadow_n; i++) {
+    s = &shadows[i];
+    s_ok = s->worst < verdict_ok*s->engine->one && s->minute >= 0;
+    agree = s->minute == minute;
+
+    s->decodes++;
+    s->worst_sum += s->worst/s->engine->one;
+    s->nsec_sum += s->nsec;
+    s->disagree += !agree;
+    s->confident_only += s_ok && !ok;
+    s->primary_only += ok && !s_ok;
+
+    printf("  Shadow %-8s frame at sample %u, worst %u, ", s->engine->name, s->frame_idx,
+	   s->worst/s->engine->one);
+    if (s->minute >= 0) {
+      minute_to_fields(s->minute, &year, &daynum, &hours, &minutes, &lyi);
+      printf("%02u:%02u day %03u", hours, minutes, daynum);
+    } else {
+      printf("no time");
+    }
+    printf(", %u usec%s%s\n", (uint32_t)(s->nsec/1000), agree ? "" : ", DISAGREES",
+	   s_ok == ok ? "" : s_ok ? ", more confident" : ", less confident");
+  }
+  fflush(stdout);
+}
+
+/* Stop the shadow threads and summarize */
+
+void shadow_stop(void)
+{
+  uint32_t i;
+  shadow_t *s;
+
+  if (shadow_n == 0) return;
+
+  pthread_mutex_lock(&shadow_lock);
+  shadow_quit = 1;
+  pthread_cond_broadcast(&shadow_go);
+  pthread_mutex_unlock(&shadow_lock);
+  for (i = 0; i < shadow_n; i++) pthread_join(shadows[i].thread, NULL);
+
+  if (shadow_decodes == 0) return;
+  printf("\nShadow decoding, %u minutes, primary %s: mean worst %.2f, %.1f usec per decode\n",
+	 shadow_decodes, engine->name, (double)shadow_worst_sum/shadow_decodes,
+	 shadow_nsec_sum/1000.0/shadow_decodes);
+  printf("  %-10s %9s %15s %15s %11s %10s\n", "engine", "disagree", "only confident", "less confident",
+	 "mean worst", "usec");
+  for (i = 0; i < shadow_n; i++) {
+    s = &shadows[i];
+    printf("  %-10s %9u %15u %15u %11.2f %10.1f\n", s->engine->name, s->disagree, s->confident_only,
+	   s->primary_only, (double)s->worst_sum/s->decodes, s->nsec_sum/1000.0/s->decodes);
+  }
+}
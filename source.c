@@ -0,0 +1,223 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Sample sources: the receiver on a Raspberry Pi GPIO, and a simulated
+ * receiver that runs on a virtual clock so schedules spanning hours can be
+ * tested in seconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <pigpio.h>
+
+#include "wwvb_dec.h"
+
+/* Receiver on GPIO.  Time is CLOCK_MONOTONIC so it does not roll over like
+ * gpioTick(). */
+
+static uint64_t gpio_now(void);
+
+/* Edges for the edge log come from a pigpio alert, in pigpio's thread.  Its
+ * ticks are usec but wrap every 72 minutes, so each is taken relative to the
+ * last. */
+
+static uint32_t gpio_alert_tick;
+static uint64_t gpio_alert_usec;
+
+static void gpio_alert(int gpio, int level, uint32_t tick)
+{
+  gpio_alert_usec += (uint32_t)(tick - gpio_alert_tick);
+  gpio_alert_tick = tick;
+  if (level == 0 || level == 1) edgelog_edge(gpio_alert_usec, level);
+}
+
+static int gpio_open(void)
+{
+  gpioCfgClock(5, 1, 1); /* this is defaults anyway */
+
+  if (gpioInitialise()<0) {
+    fprintf(stderr, "Could not initialize GPIO library\n");
+    return -1;
+  }
+
+  gpioSetMode(PDN_GPIO, PI_OUTPUT);
+  gpioWrite(PDN_GPIO, 0);
+
+  if (edgelog_enabled) {
+    gpio_alert_usec = gpio_now();
+    gpio_alert_tick = gpioTick();
+    gpioSetAlertFunc(GPIO, gpio_alert);
+  }
+
+  return 0;
+}
+
+static void gpio_close(void)
+{
+  gpioTerminate();
+}
+
+static uint64_t gpio_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+}
+
+static uint64_t gpio_realtime(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+}
+
+static void gpio_wait_until(uint64_t usec)
+{
+  while (gpio_now() < usec) {}
+}
+
+static void gpio_sleep(uint64_t usec)
+{
+  struct timespec ts;
+
+  ts.tv_sec = usec/1000000;
+  ts.tv_nsec = (usec % 1000000)*1000;
+  while (nanosleep(&ts, &ts) != 0) {}
+}
+
+static uint32_t gpio_read(void)
+{
+  return gpioRead(GPIO);
+}
+
+static void gpio_power(int on)
+{
+  gpioWrite(PDN_GPIO, !on);
+}
+
+source_t gpio_source = {"gpio", gpio_open, gpio_close, gpio_now, gpio_realtime, gpio_wait_until,
+			gpio_sleep, gpio_read, gpio_power};
+
+/* Simulated receiver.  The virtual clock only advances when waited on.  It
+ * runs SIM_PPM slow relative to WWVB so lock tracking sees drift.  Each
+ * sample is flipped with probability sim_noise_pct percent, plus SIM_DAY_PCT
+ * during North American daytime when propagation is poor, and the output is
+ * random for SIM_WARMUP_SEC after power up.  The host wall clock is exact. */
+
+#define SIM_PPM 30
+#define SIM_WARMUP_SEC 3
+#define SIM_DAY_PCT 8
+#define SIM_DAY_START 15  /* UTC hours */
+#define SIM_DAY_END 23
+
+uint32_t sim_noise_pct;
+
+static uint64_t sim_time, sim_epoch, sim_power_on;
+static int sim_powered;
+static uint32_t sim_level;
+static int32_t sim_minute = -1;
+static uint8_t sim_secs[60];
+
+static int sim_open(void)
+{
+  srand(time(NULL));
+
+  /* WWVB time, in usec since 2000, at virtual time 0.  Random phase within the
+   * minute. */
+  sim_epoch = (time(NULL) - EPOCH_2000)*1000000ULL + rand() % 60000000;
+  sim_time = 0;
+  sim_powered = 1;
+  sim_power_on = 0;
+  sim_level = 0;
+
+  return 0;
+}
+
+static void sim_close(void)
+{
+}
+
+static uint64_t sim_now(void)
+{
+  return sim_time;
+}
+
+static uint64_t sim_realtime(void)
+{
+  return sim_epoch + sim_time + EPOCH_2000*1000000ULL;
+}
+
+static void sim_wait_until(uint64_t usec)
+{
+  if (usec > sim_time) sim_time = usec;
+}
+
+static void sim_sleep(uint64_t usec)
+{
+  sim_time += usec;
+}
+
+static uint32_t sim_output(void)
+{
+  uint64_t wwvb;
+  uint32_t level, ms, noise, hour;
+  int32_t minute;
+
+  if (!sim_powered) return 0;
+  if (sim_time - sim_power_on < SIM_WARMUP_SEC*1000000ULL) return rand() & 1;
+
+  wwvb = sim_epoch + sim_time + sim_time/1000000*SIM_PPM;
+  minute = wwvb/60000000;
+  if (minute != sim_minute) {
+    encode_frame(minute, 0, 0, sim_secs);
+    sim_minute = minute;
+  }
+
+  /* Carrier is reduced (0) for the first 200, 500, or 800 ms of a zero, one,
+   * or mark */
+  ms = wwvb % 1000000 / 1000;
+  switch (sim_secs[wwvb/1000000 % 60]) {
+  case 0:
+    level = ms >= 200;
+    break;
+  case 1:
+    level = ms >= 500;
+    break;
+  default:
+    level = ms >= 800;
+    break;
+  }
+
+  noise = sim_noise_pct;
+  hour = minute/60 % 24;
+  if (hour >= SIM_DAY_START && hour < SIM_DAY_END) noise += SIM_DAY_PCT;
+  if ((uint32_t)(rand() % 100) < noise) level ^= 1;
+
+  return level;
+}
+
+/* Changes of output are logged as edges at the time they are seen */
+
+static uint32_t sim_read(void)
+{
+  uint32_t level = sim_output();
+
+  if (edgelog_enabled && level != sim_level) edgelog_edge(sim_time, level);
+  sim_level = level;
+
+  return level;
+}
+
+static void sim_power(int on)
+{
+  if (on && !sim_powered) sim_power_on = sim_time;
+  sim_powered = on;
+}
+
+source_t sim_source = {"sim", sim_open, sim_close, sim_now, sim_realtime, sim_wait_until,
+		       sim_sleep, sim_read, sim_power};
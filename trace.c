@@ -0,0 +1,135 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Optional timeline tracing in the Chrome trace event format, for viewing in
+ * Perfetto (ui.perfetto.dev) or chrome://tracing.
+ *
+ * Each thread records begin and end events into its own ring buffer, so
+ * recording takes no locks.  A thread's buffer is allocated on its first event
+ * and pushed onto a list with compare and swap.  When the ring is full the
+ * oldest events are overwritten.  The buffers are written out as JSON by
+ * trace_dump() when the program exits.
+ *
+ * When tracing is off, TRACE_BEGIN() and TRACE_END() cost one predictable
+ * branch on trace_enabled.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "wwvb_dec.h"
+
+#define TRACE_BUF_EVENTS 65536
+
+typedef struct {
+  const char *name;
+  uint64_t usec;
+  char ph;
+} trace_ev_t;
+
+typedef struct trace_buf {
+  struct trace_buf *next;
+  uint32_t tid;
+  const char *thread_name;
+  _Atomic uint32_t head;  /* events ever written */
+  trace_ev_t ev[TRACE_BUF_EVENTS];
+} trace_buf_t;
+
+int trace_enabled;
+
+static char *trace_fname;
+static _Atomic(trace_buf_t *) trace_bufs;
+static __thread trace_buf_t *trace_buf;
+
+int trace_open(char *fname)
+{
+  trace_fname = fname;
+  trace_enabled = 1;
+  return 0;
+}
+
+static trace_buf_t *trace_new_buf(void)
+{
+  trace_buf_t *b;
+
+  if ((b = calloc(1, sizeof(*b))) == NULL) {
+    fprintf(stderr, "Error: out of memory for trace buffer\n");
+    exit(EXIT_FAILURE);
+  }
+  b->tid = syscall(SYS_gettid);
+
+  b->next = atomic_load(&trace_bufs);
+  while (!atomic_compare_exchange_weak(&trace_bufs, &b->next, b)) {}
+
+  trace_buf = b;
+  return b;
+}
+
+/* Name the calling thread in the trace */
+
+void trace_thread_name(const char *name)
+{
+  if (!trace_enabled) return;
+  if (trace_buf == NULL) trace_new_buf();
+  trace_buf->thread_name = name;
+}
+
+void trace_event(const char *name, char ph)
+{
+  trace_buf_t *b = trace_buf;
+  trace_ev_t *e;
+  struct timespec ts;
+  uint32_t h;
+
+  if (b == NULL) b = trace_new_buf();
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  h = atomic_load_explicit(&b->head, memory_order_relaxed);
+  e = &b->ev[h % TRACE_BUF_EVENTS];
+  e->name = name;
+  e->ph = ph;
+  e->usec = ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+  atomic_store_explicit(&b->head, h + 1, memory_order_release);
+}
+
+/* Write all buffers as a Chrome trace event JSON file */
+
+void trace_dump(void)
+{
+  FILE *fp;
+  trace_buf_t *b;
+  trace_ev_t *e;
+  uint32_t h, i, n;
+  int pid = getpid(), first = 1;
+
+  if (!trace_enabled) return;
+
+  if ((fp = fopen(trace_fname, "w")) == NULL) {
+    fprintf(stderr, "Warning: could not open file %s for writing\n", trace_fname);
+    return;
+  }
+
+  fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  for (b = atomic_load(&trace_bufs); b != NULL; b = b->next) {
+    if (b->thread_name != NULL) {
+      fprintf(fp, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %u, "
+	      "\"args\": {\"name\": \"%s\"}}", first ? "" : ",", pid, b->tid, b->thread_name);
+      first = 0;
+    }
+    h = atomic_load_explicit(&b->head, memory_order_acquire);
+    n = h < TRACE_BUF_EVENTS ? h : TRACE_BUF_EVENTS;
+    for (i = h - n; i != h; i++) {
+      e = &b->ev[i % TRACE_BUF_EVENTS];
+      fprintf(fp, "%s\n{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %llu, \"pid\": %d, \"tid\": %u}",
+	      first ? "" : ",", e->name, e->ph, (unsigned long long)e->usec, pid, b->tid);
+      first = 0;
+    }
+  }
+  fprintf(fp, "\n]}\n");
+  fclose(fp);
+}
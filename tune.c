@@ -0,0 +1,293 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Decoder settings autotuner.  Every combination of
+ *
+ *   engine   -e, each of the engines, llr with the -Y table if one is given
+ *   verdict  -v, the errors in the worst second under which a decode is
+ *            accepted, TUNE_V_MIN to VERDICT_UNRELIABLE
+ *
+ * is scored on a labeled corpus from -A with the decoder itself,
+ * find_frame() and decode_frame(): how many minutes are accepted and right,
+ * how many are accepted and wrong, and the CPU time per decode.  The settings
+ * that no other beats on all three are printed, cheapest first, as the
+ * options that select them.
+ *
+ * The corpus is read into memory once.  Each file is copied to bits[] and
+ * decoded once by every engine, and every verdict is judged from the decode's
+ * worst second, so the verdicts cost nothing.  The engines decode on a thread
+ * each, as shadow engines do in -C: engine, frame[] and the perf counters are
+ * per thread, each engine's tables are its own, and bits[] is only read
+ * until all of them are done with it.
+ *
+ * Only -e and -v are tuned, they are the decoder's only settings.  The
+ * sample rate is SAMP_PERIOD, fixed at build time, and the lengths of the
+ * symbol templates follow from it and the WWVB format.  No filter stands
+ * between the receiver and bits[] to tune.  The llr engine learns its
+ * symbol shapes from a corpus with -U instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "wwvb_dec.h"
+
+#define TUNE_V_MIN 3
+#define TUNE_V_N (VERDICT_UNRELIABLE - TUNE_V_MIN + 1)
+#define TUNE_ENGINES 8
+
+typedef struct {
+  int32_t minute;       /* true minute */
+  uint8_t *bits;
+} tune_file_t;
+
+/* Decode of one file by one engine */
+typedef struct {
+  uint32_t worst;       /* in the engine's units */
+  int32_t minute;       /* -1 if none */
+  uint64_t nsec;
+} tune_out_t;
+
+static tune_file_t *tune_files;
+static uint32_t tune_nfiles;
+static tune_out_t *tune_out;          /* [engine][file] */
+
+/* The main thread raises tune_gen when tune_file is in bits[], and each
+ * engine's thread raises tune_done when it has decoded it */
+static pthread_mutex_t tune_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tune_go = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t tune_fin = PTHREAD_COND_INITIALIZER;
+static uint32_t tune_gen, tune_done, tune_file;
+static int tune_quit;
+
+static void tune_free(void)
+{
+  uint32_t f;
+
+  for (f = 0; f < tune_nfiles; f++) free(tune_files[f].bits);
+  free(tune_files);
+  free(tune_out);
+  tune_files = NULL;
+  tune_out = NULL;
+  tune_nfiles = 0;
+}
+
+/* Read the corpus in dir, as indexed in index.txt by -A, into memory */
+
+static int tune_load(char *dir)
+{
+  char fname[1024], line[1024], file[256];
+  FILE *fp, *bp;
+  int32_t minute;
+  uint32_t cap = 0;
+  uint8_t *b;
+
+  snprintf(fname, sizeof(fname), "%s/index.txt", dir);
+  if ((fp = fopen(fname, "r")) == NULL) {
+    fprintf(stderr, "Error: could not open file %s for reading\n", fname);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == '#' || sscanf(line, "%255s %d", file, &minute) != 2) continue;
+    snprintf(fname, sizeof(fname), "%s/%s", dir, file);
+    if ((bp = fopen(fname, "rb")) == NULL) {
+      fprintf(stderr, "Warning: could not open file %s for reading\n", fname);
+      continue;
+    }
+    if (tune_nfiles == cap) {
+      cap = cap ? 2*cap : 256;
+      if ((tune_files = realloc(tune_files, cap*sizeof(tune_file_t))) == NULL) {
+	fprintf(stderr, "Error: out of memory\n");
+	fclose(bp);
+	fclose(fp);
+	return -1;
+      }
+    }
+    if ((b = calloc(BLEN, 1)) == NULL) {
+      fprintf(stderr, "Error: out of memory\n");
+      fclose(bp);
+      fclose(fp);
+      return -1;
+    }
+    if (fread(b, 1, BLEN, bp) < BLEN) fprintf(stderr, "Warning: %s likely too short\n", fname);
+    fclose(bp);
+    tune_files[tune_nfiles].minute = minute;
+    tune_files[tune_nfiles].bits = b;
+    tune_nfiles++;
+  }
+  fclose(fp);
+
+  if (tune_nfiles == 0) {
+    fprintf(stderr, "Error: no labeled files in %s\n", dir);
+    return -1;
+  }
+  return 0;
+}
+
+/* Decode each file in bits[] with engine number arg */
+
+static void *tune_worker(void *arg)
+{
+  uint32_t e = (uintptr_t)arg, gen = 0, frame_idx, min_val;
+  tune_out_t *o;
+  uint64_t t;
+
+  engine = engine_nth(e);
+  trace_thread_name(engine->name);
+
+  for (;;) {
+    pthread_mutex_lock(&tune_lock);
+    while (tune_gen == gen && !tune_quit) pthread_cond_wait(&tune_go, &tune_lock);
+    gen = tune_gen;
+    pthread_mutex_unlock(&tune_lock);
+    if (tune_quit) break;
+
+    o = &tune_out[e*tune_nfiles + tune_file];
+    t = shadow_cpu_nsec();
+    frame_idx = find_frame(BLEN, &min_val);
+    decode_frame(frame_idx);
+    o->nsec = shadow_cpu_nsec() - t;
+    o->worst = frame_worst_score();
+    o->minute = frame_minute();
+
+    pthread_mutex_lock(&tune_lock);
+    tune_done++;
+    pthread_cond_signal(&tune_fin);
+    pthread_mutex_unlock(&tune_lock);
+  }
+
+  return NULL;
+}
+
+typedef struct {
+  uint32_t e, v;
+  uint32_t right, wrong;
+  double usec;
+  int front;
+} tune_result_t;
+
+/* Whether a is at least as good as b on all three, and better on one.  Of
+ * equals, the first is kept. */
+
+static int tune_dominates(tune_result_t *a, tune_result_t *b)
+{
+  return a->right >= b->right && a->wrong <= b->wrong && a->usec <= b->usec &&
+    (a->right > b->right || a->wrong < b->wrong || a->usec < b->usec);
+}
+
+static int tune_by_cost(const void *a, const void *b)
+{
+  const tune_result_t *x = a, *y = b;
+
+  return x->usec < y->usec ? -1 : x->usec > y->usec;
+}
+
+static void tune_print(tune_result_t *r, char *note)
+{
+  printf("  %-10s %7u %7u %7u %10.1f%s\n", engine_nth(r->e)->name, r->v, r->right, r->wrong, r->usec,
+	 note);
+}
+
+/* Tune on the corpus in dir */
+
+int tune_run(char *dir)
+{
+  static tune_result_t res[TUNE_ENGINES*TUNE_V_N];
+  pthread_t threads[TUNE_ENGINES];
+  uint32_t e, v, f, i, j, nres = 0, neng, nthreads, nfront = 0;
+  tune_out_t *o;
+  tune_result_t *r;
+  int ret = 0;
+
+  if (tune_load(dir) < 0) {
+    tune_free();
+    return -1;
+  }
+  for (neng = 0; engine_nth(neng) != NULL && neng < TUNE_ENGINES; neng++)
+    ;
+  if ((tune_out = calloc((size_t)neng*tune_nfiles, sizeof(tune_out_t))) == NULL) {
+    fprintf(stderr, "Error: out of memory\n");
+    tune_free();
+    return -1;
+  }
+  printf("Tuning on %u labeled minutes, %u engines on a thread each%s\n", tune_nfiles, neng,
+	 llr_loaded ? ", llr with its table" : "");
+
+  for (nthreads = 0; nthreads < neng; nthreads++) {
+    if (pthread_create(&threads[nthreads], NULL, tune_worker, (void *)(uintptr_t)nthreads) != 0) {
+      fprintf(stderr, "Error: could not start tuning thread\n");
+      ret = -1;
+      break;
+    }
+  }
+
+  for (f = 0; f < tune_nfiles && ret == 0 && !wwvb_stop; f++) {
+    memcpy(bits, tune_files[f].bits, BLEN);
+    engine_invalidate(0);
+    pthread_mutex_lock(&tune_lock);
+    tune_file = f;
+    tune_done = 0;
+    tune_gen++;
+    pthread_cond_broadcast(&tune_go);
+    while (tune_done < neng) pthread_cond_wait(&tune_fin, &tune_lock);
+    pthread_mutex_unlock(&tune_lock);
+  }
+
+  pthread_mutex_lock(&tune_lock);
+  tune_quit = 1;
+  pthread_cond_broadcast(&tune_go);
+  pthread_mutex_unlock(&tune_lock);
+  for (i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+  if (ret < 0 || wwvb_stop) {
+    tune_free();
+    return -1;
+  }
+
+  for (e = 0; e < neng; e++) {
+    for (v = TUNE_V_MIN; v <= VERDICT_UNRELIABLE; v++) {
+      r = &res[nres++];
+      r->e = e;
+      r->v = v;
+      r->right = r->wrong = 0;
+      r->usec = 0;
+      for (f = 0; f < tune_nfiles; f++) {
+	o = &tune_out[e*tune_nfiles + f];
+	r->usec += o->nsec/1000.0;
+	if (o->minute < 0 || o->worst >= v*engine_nth(e)->one) continue;
+	if (o->minute == tune_files[f].minute)
+	  r->right++;
+	else
+	  r->wrong++;
+      }
+      r->usec /= tune_nfiles;
+    }
+  }
+
+  for (i = 0; i < nres; i++) {
+    res[i].front = 1;
+    for (j = 0; j < nres && res[i].front; j++)
+      if (j != i && (tune_dominates(&res[j], &res[i]) ||
+		     (j < i && res[j].right == res[i].right && res[j].wrong == res[i].wrong &&
+		      res[j].usec == res[i].usec)))
+	res[i].front = 0;
+    nfront += res[i].front;
+  }
+  qsort(res, nres, sizeof(res[0]), tune_by_cost);
+
+  printf("  %-10s %7s %7s %7s %10s\n", "-e", "-v", "right", "wrong", "usec");
+  for (i = 0; i < nres; i++) {
+    if (engine_nth(res[i].e) == engine && res[i].v == verdict_ok)
+      tune_print(&res[i], res[i].front ? "  (current)" : "  (current, not on front)");
+    else if (res[i].front)
+      tune_print(&res[i], "");
+  }
+  printf("  %u of %u settings on the front\n", nfront, nres);
+
+  tune_free();
+  return 0;
+}
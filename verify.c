@@ -0,0 +1,151 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * System clock verification.  When the host clock is roughly right there is
+ * no need to search for the frame and decode it blind: the start of the next
+ * minute and every time field in it follow from CLOCK_REALTIME.  One frame is
+ * captured around the predicted start, and the expected frame for that minute
+ * and the minutes either side is scored directly against the samples at each
+ * offset within the window.  The best hypothesis says whether WWVB confirms the
+ * system time, and its offset says by how much the clock is off.
+ *
+ * DUT1, LSW and DST cannot be predicted from the system clock, so their
+ * seconds are not scored.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "wwvb_dec.h"
+
+/* Least time to the predicted frame start for it to be captured */
+#define VERIFY_LEAD_USEC 1000000
+
+/* Minutes either side of the system time tried */
+#define VERIFY_NEIGHBORS 1
+
+#define VERIFY_HYPS (2*VERIFY_NEIGHBORS + 1)
+
+/* Score of the frame secs[] (0, 1 or 2 for mark) starting at sample samp_idx,
+ * over the seconds marked in known[].  Stops early once over min_val, like
+ * xor_frame().  Also the worst score of any one second. */
+
+static uint32_t xor_template(uint32_t samp_idx, uint8_t *secs, uint8_t *known, uint32_t min_val,
+			     uint32_t *worst)
+{
+  uint32_t i, res, sum = 0;
+
+  *worst = 0;
+  for (i = 0; i < 60 && sum <= min_val; i++) {
+    if (!known[i]) continue;
+    switch (secs[i]) {
+    case 0:
+      res = xor_zero(samp_idx + i*SAMPLES_PER_SEC);
+      break;
+    case 1:
+      res = xor_one(samp_idx + i*SAMPLES_PER_SEC);
+      break;
+    default:
+      res = xor_mark(samp_idx + i*SAMPLES_PER_SEC);
+      break;
+    }
+    sum += res;
+    if (res > *worst) *worst = res;
+  }
+
+  return sum;
+}
+
+/* Capture the next frame and test it against the system time, searching
+ * window_usec either side of the frame start the system clock predicts.
+ * Returns 0 if WWVB confirms the system time to within the window. */
+
+int verify_run(source_t *src, uint32_t window_usec, int print_flag)
+{
+  uint8_t secs[VERIFY_HYPS][60], known[60];
+  uint64_t now, realtime, start, first, marker;
+  int64_t offset;
+  int32_t minute, h, best_h = 0;
+  uint32_t win, len, i, res, worst, min_val, best_idx = 0, best_worst = 0;
+  uint32_t hyp_val[VERIFY_HYPS], year, daynum, hours, minutes, lyi;
+  int confirmed;
+
+  /* Predicted start of the next minute with time to get to it */
+  now = src->now();
+  realtime = src->realtime();
+  minute = (realtime/1000000 - EPOCH_2000)/60 + 1;
+  start = ((uint64_t)minute*60 + EPOCH_2000)*1000000ULL;
+  if (start - realtime < window_usec + VERIFY_LEAD_USEC) {
+    minute++;
+    start += 60000000ULL;
+  }
+
+  win = window_usec/SAMP_PERIOD_USEC;
+  if (win == 0) win = 1;
+  len = 60*SAMPLES_PER_SEC + 2*win + 1;
+  if (len > BLEN) {
+    fprintf(stderr, "Error: verify window too large\n");
+    return -1;
+  }
+
+  frame_time_secs(known);
+  for (h = 0; h < VERIFY_HYPS; h++)
+    encode_frame(minute + h - VERIFY_NEIGHBORS, 0, 0, secs[h]);
+
+  minute_to_fields(minute, &year, &daynum, &hours, &minutes, &lyi);
+  printf("\nVerifying system time %02u:%02u UTC day %03u of year %02u, +/- %.0f ms\n",
+	 hours, minutes, daynum, year, win*SAMP_PERIOD_USEC/1000.0);
+
+  first = now + (start - realtime) - win*(uint64_t)SAMP_PERIOD_USEC;
+  if (first > src->now() + 20000) src->sleep(first - 20000 - src->now());
+  if (live_enabled) live_start(win);
+  fill_late_max = 0;
+  fill_buffer_from(src, 0, len, first);
+  if (wwvb_stop) return -1;
+
+  /* A handful of window scores, rather than find_frame() and decode_frame() */
+  TRACE_BEGIN("verify");
+  min_val = 0xffffffff;
+  for (h = 0; h < VERIFY_HYPS; h++) {
+    hyp_val[h] = 0xffffffff;
+    for (i = 0; i + 60*SAMPLES_PER_SEC <= len; i++) {
+      res = xor_template(i, secs[h], known, hyp_val[h], &worst);
+      if (res < hyp_val[h]) {
+	hyp_val[h] = res;
+	if (res < min_val) {
+	  min_val = res;
+	  best_h = h;
+	  best_idx = i;
+	}
+      }
+    }
+  }
+  xor_template(best_idx, secs[best_h], known, 0xffffffff, &best_worst);
+  TRACE_END("verify");
+
+  if (print_flag) print_frame(best_idx);
+
+  for (h = 0; h < VERIFY_HYPS; h++)
+    printf("  Minute %+d: score %u%s\n", h - VERIFY_NEIGHBORS, score_errors(hyp_val[h]),
+	   h == best_h ? " (best)" : "");
+
+  /* Offset of the system clock from WWVB at the on-time marker, taken as half
+   * a sample before the first sample of the frame as in monitor mode */
+  marker = first + best_idx*(uint64_t)SAMP_PERIOD_USEC - SAMP_PERIOD_USEC/2 - monitor_delay_usec;
+  offset = (int64_t)(fill_realtime(marker) -
+		     ((uint64_t)(minute + best_h - VERIFY_NEIGHBORS)*60 + EPOCH_2000)*1000000ULL);
+
+  confirmed = best_h == VERIFY_NEIGHBORS && best_worst < verdict_ok*engine->one;
+  if (confirmed)
+    printf("  Verify: WWVB confirms system time, clock %+.1f ms +/- %.1f ms, worst second %u\n",
+	   offset/1000.0, (SAMP_PERIOD_USEC/2 + fill_late_max)/1000.0, score_errors(best_worst));
+  else if (best_worst < verdict_ok*engine->one)
+    printf("  Verify: system clock is off by %+.3f s, worst second %u\n", offset/1e6,
+	   score_errors(best_worst));
+  else
+    printf("  Verify: not confirmed, best worst second %u %s\n", score_errors(best_worst),
+	   best_worst < VERDICT_UNRELIABLE*engine->one ? "NOT RELIABLE" : "PROBABLY BAD");
+
+  return confirmed ? 0 : -1;
+}
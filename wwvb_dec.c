@@ -11,26 +11,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <unistd.h>
+#include <signal.h>
 
-#include <pigpio.h>
-
-/* GPIO4 is pin 7 on Raspberry PI Zero */
-#define GPIO 4
-
-/* Choose SAMP_PERIOD to evenly divide 200, 500, and 800 */
-#define SAMP_PERIOD 25
-#define SAMP_PERIOD_USEC (1000*SAMP_PERIOD)
-#define BUF_LEN_IN_SEC 120
-#define SAMPLES_PER_SEC (1000/SAMP_PERIOD)
-#define BLEN (SAMPLES_PER_SEC*BUF_LEN_IN_SEC)
-
-#define DECODE_FAILURE (9999)
-
-typedef struct {
-  uint32_t bit;
-  uint32_t weight;
-} code_t;
+#include "wwvb_dec.h"
 
 /* The frame is made up of 60 bits (or markers).  These "codes" show which bits
  * make up a field.  See Wikipedia on WWVB.  Each bit takes one second in the
@@ -46,19 +31,10 @@ code_t lyi_code[] = {{55, 1}};
 code_t lsw_code[] = {{56, 1}};
 code_t dst_code[] = {{57, 2}, {58, 1}};
 
-typedef struct {
-  char *name;
-  uint32_t value;
-  uint32_t score;
-  uint32_t worst_score;
-  uint32_t val_width;
-  code_t *code;
-  uint32_t code_len;
-} field_t;
+/* A frame contains fields, organized into this array.  Each thread has its
+ * own, so shadow engines decode alongside the primary. */
 
-/* A frame contains fields, organized into this array */
-
-field_t frame[] = {
+__thread field_t frame[NUM_FIELDS] = {
   {"hours",  0xffffffff, 0xffffffff, 0xffffffff, 2, hours_code, sizeof(hours_code)/sizeof(hours_code[0])},
   {"minutes", 0xffffffff, 0xffffffff, 0xffffffff, 2, minutes_code, sizeof(minutes_code)/sizeof(minutes_code[0])},
   {"day",  0xffffffff, 0xffffffff, 0xffffffff, 3, day_code, sizeof(day_code)/sizeof(day_code[0])},
@@ -68,19 +44,14 @@ field_t frame[] = {
   {"dst",  0xffffffff, 0xffffffff, 0xffffffff, 2, dst_code, sizeof(dst_code)/sizeof(dst_code[0])}
 };
 
-/* Indices for above */
-#define HOURS 0
-#define MINUTES 1
-#define DAYNUM 2
-#define YEAR 3
-#define LYI 4
-#define LSW 5
-#define DST 6
-
-
 /* circular buffer of sampled bits from receiver */
 uint8_t bits[BLEN];
 
+volatile int wwvb_stop;
+
+/* A decode is accepted if its worst second has fewer errors than this, -v */
+uint32_t verdict_ok = VERDICT_OK;
+
 /* Read bits from a file for offline processing */
 
 void fill_buffer_file(char *fname)
@@ -94,6 +65,7 @@ void fill_buffer_file(char *fname)
 
   if (fread(bits, sizeof(bits[0]), sizeof(bits)/sizeof(bits[0]), fp) < 60*SAMPLES_PER_SEC)
     fprintf(stderr, "Warning: input file likely too short\n");
+  engine_invalidate(0);
 
   fclose(fp);
 }
@@ -109,25 +81,95 @@ void save_buffer_file(char *fname)
   return;
 }
 
+  TRACE_BEGIN("save_buffer_file");
   fwrite(bits, 1, sizeof(bits), fp);
   fclose(fp);
+  TRACE_END("save_buffer_file");
 }
 
 
-/* Fill the buffer of bits by sampling the GPIO.  This could be senstive to the
- * accuracy and jitter of gpioTick. */
+/* The host wall clock, read alongside the source clock once a second while
+ * sampling, to convert sample times to wall clock times.  Also the latest a
+ * sample was read after its due time in the current capture, in usec. */
+
+#define FILL_CLOCK_LEN 256
+
+static struct {
+  uint64_t now;
+  uint64_t realtime;
+} fill_clock[FILL_CLOCK_LEN];
+static uint32_t fill_clock_next;
+
+uint32_t fill_late_max;
 
-void fill_buffer_gpio(void)
+static void fill_clock_mark(source_t *src, uint64_t due)
 {
-  uint32_t i, first_tick;
+  uint64_t now = src->now();
 
-  first_tick = gpioTick();
-  bits[0] = gpioRead(GPIO);
+  fill_clock[fill_clock_next].now = now;
+  fill_clock[fill_clock_next].realtime = src->realtime();
+  fill_clock_next = (fill_clock_next + 1) % FILL_CLOCK_LEN;
+  if (now - due > fill_late_max) fill_late_max = now - due;
+}
+
+/* Host wall clock at recent source time t, usec since the Unix epoch */
 
-  for (i = 1; i < BLEN; i++) {
-    while (gpioTick() < first_tick + i*SAMP_PERIOD_USEC) {}
-    bits[i] = gpioRead(GPIO);
+uint64_t fill_realtime(uint64_t t)
+{
+  uint32_t i, best = 0;
+  uint64_t d, best_d = (uint64_t)-1;
+
+  for (i = 0; i < FILL_CLOCK_LEN; i++) {
+    d = t > fill_clock[i].now ? t - fill_clock[i].now : fill_clock[i].now - t;
+    if (fill_clock[i].now != 0 && d < best_d) {
+      best_d = d;
+      best = i;
+    }
+  }
+
+  return fill_clock[best].realtime + (t - fill_clock[best].now);
+}
+
+/* Fill samples start to len - 1 of the buffer of bits from a sample source,
+ * sample i due at source time first_tick + i*SAMP_PERIOD_USEC.  Samples before
+ * start are left from an earlier capture.  This could be senstive to the
+ * accuracy and jitter of the source clock.  Gives up early if wwvb_stop is
+ * set.  fill_late_max is only raised, callers clear it for a new capture. */
+
+void fill_buffer_from(source_t *src, uint32_t start, uint32_t len, uint64_t first_tick)
+{
+  uint32_t i;
+  uint64_t due;
+
+  engine_invalidate(start);
+  TRACE_BEGIN("sample");
+
+  for (i = start; i < len && !wwvb_stop; i++) {
+    if (i % SAMPLES_PER_SEC == 0 && i > start) {
+      TRACE_END("sample");
+      TRACE_BEGIN("sample");
+    }
+    due = first_tick + (uint64_t)i*SAMP_PERIOD_USEC;
+    src->wait_until(due);
+    bits[i] = src->read();
+    if (i % SAMPLES_PER_SEC == 0) fill_clock_mark(src, due);
+    if (live_enabled) live_sample(i);
+    if (early_enabled) early_sample(i);
   }
+  TRACE_END("sample");
+}
+
+/* Fill the first len samples of the buffer of bits, starting now.  Returns the
+ * source time of the first sample. */
+
+uint64_t fill_buffer(source_t *src, uint32_t len)
+{
+  uint64_t first_tick = src->now();
+
+  fill_late_max = 0;
+  fill_buffer_from(src, 0, len, first_tick);
+
+  return first_tick;
 }
 
 /* Count errors in bit (or marker) which occuplies 1 second.  Do this by
@@ -150,19 +192,22 @@ uint32_t xor_sec(uint32_t samp_idx, uint32_t zero_len, uint32_t one_len)
   return sum;
 }
 
+/* The scores of a second against a mark, zero, and one, as computed by the
+ * current engine (see engine.c).  The xor engine calls xor_sec(). */
+
 uint32_t xor_mark(uint32_t samp_idx)
 {
-  return xor_sec(samp_idx, 800/SAMP_PERIOD, 200/SAMP_PERIOD);
+  return engine->score(samp_idx, 2);
 }
 
 uint32_t xor_zero(uint32_t samp_idx)
 {
-  return xor_sec(samp_idx, 200/SAMP_PERIOD, 800/SAMP_PERIOD);
+  return engine->score(samp_idx, 0);
 }
 
 uint32_t xor_one(uint32_t samp_idx)
 {
-  return xor_sec(samp_idx, 500/SAMP_PERIOD, 500/SAMP_PERIOD);
+  return engine->score(samp_idx, 1);
 }
 
 
@@ -224,31 +269,135 @@ uint32_t xor_frame(uint32_t samp_idx, uint32_t min_val)
   return sum;
 }
 
-/* Search through the bit buffer for the sample that best works as the start of the
- * frame. This will always find something-- even random data has a sample that works
- * best as a frame, even if it works poorly! Random data would yield a decode with
- * a very poor score (count of sampled bits that are in error. */
+/* Search through the first len samples of the bit buffer for the sample that best
+ * works as the start of the frame. This will always find something-- even random
+ * data has a sample that works best as a frame, even if it works poorly! Random
+ * data would yield a decode with a very poor score (count of sampled bits that
+ * are in error. */
 
-uint32_t find_frame(uint32_t *min_val)
+uint32_t find_frame(uint32_t len, uint32_t *min_val)
 {
-  uint32_t samp_idx, min_idx, lmin, res;
+  uint32_t min_idx = BLEN + BLEN;
+
+  *min_val = SAMPLES_PER_SEC * 120 * engine->one;
+  find_frame_from(0, len, &min_idx, min_val);
+
+  return min_idx;
+}
 
-  min_idx = BLEN + BLEN;
-  lmin = SAMPLES_PER_SEC * 120;
+/* Continue a search for the start of the frame from sample from, through the
+ * samples that leave a whole frame in the first len samples.  min_idx and
+ * min_val are the best so far, and are updated if a better start is found.
+ * Returns 1 if it was. */
 
-  for (samp_idx = 0; samp_idx < BLEN - SAMPLES_PER_SEC*60; samp_idx++) {
+int find_frame_from(uint32_t from, uint32_t len, uint32_t *min_idx, uint32_t *min_val)
+{
+  uint32_t samp_idx, lmin, res;
+  int found = 0;
+
+  TRACE_BEGIN("find_frame");
+  if (perf_enabled) perf_begin(PERF_FIND_FRAME);
+
+  engine->prepare(len);
+  lmin = *min_val;
+
+  for (samp_idx = from; samp_idx + SAMPLES_PER_SEC*60 < len; samp_idx++) {
     res =  xor_frame(samp_idx, lmin);
     if (res < lmin) {
       lmin = res;
-      min_idx = samp_idx;
+      *min_idx = samp_idx;
+      found = 1;
     }
   }
 
+  if (perf_enabled) perf_end(PERF_FIND_FRAME, samp_idx > from ? samp_idx - from : 0);
+  TRACE_END("find_frame");
+
   *min_val = lmin;
-  return min_idx;
+  return found;
 }
 
+/* Whether a start other than frame_idx, at any phase within the minute,
+ * scores better than min_val on the constant seconds of the first len
+ * samples.  The constant seconds are the same in every frame, so where a
+ * frame from a start would run past len its seconds are scored a minute
+ * earlier, in the frame before.  This needs len of at least 61 seconds and
+ * searches the starts whose whole frame is not in the buffer yet, which
+ * find_frame_from() can not. */
 
+static int frame_phase_better(uint32_t frame_idx, uint32_t len, uint32_t min_val)
+{
+  uint32_t phase, i, pos, sum;
+
+  for (phase = 0; phase < 60*SAMPLES_PER_SEC; phase++) {
+    if (phase == frame_idx) continue;
+    sum = 0;
+    for (i = 0; i < sizeof(frame_const_fields)/sizeof(frame_const_fields[0]) && sum < min_val; i++) {
+      pos = phase + frame_const_fields[i].sec*SAMPLES_PER_SEC;
+      if (pos + SAMPLES_PER_SEC > len) pos -= 60*SAMPLES_PER_SEC;
+      sum += frame_const_fields[i].type == 2 ? xor_mark(pos) : xor_zero(pos);
+    }
+    if (sum < min_val) return 1;
+  }
+
+  return 0;
+}
+
+/* Sample until a confident frame has been decoded, rather than for a fixed
+ * time.  Once a whole frame could be in the buffer, the search for the frame
+ * is extended over each new second's worth of start samples, and the best
+ * frame so far is decoded whenever it changes.  Sampling stops once that
+ * frame decodes confidently, scores under FRAME_OK on its constant seconds,
+ * and no start at another phase of the minute scores better, so a frame off
+ * by whole seconds is not taken for the true one while the true one is not
+ * yet whole in the buffer.  When the buffer is full, the oldest minute is
+ * dropped to make room for the next frame, up to CAPTURE_MAX_SEC of sampling
+ * in all.  Returns the source time of the first sample in the buffer, and the
+ * length of the buffer, frame start and its score in len, frame_idx and
+ * min_val. */
+
+uint64_t fill_buffer_adaptive(source_t *src, uint32_t *len, uint32_t *frame_idx, uint32_t *min_val)
+{
+  uint64_t first = src->now();
+  uint32_t n, from = 0, sampled;
+
+  fill_late_max = 0;
+  *frame_idx = BLEN + BLEN;
+  *min_val = SAMPLES_PER_SEC * 120 * engine->one;
+
+  n = 60*SAMPLES_PER_SEC;
+  fill_buffer_from(src, 0, n, first);
+  sampled = n;
+
+  while (!wwvb_stop && sampled < CAPTURE_MAX_SEC*SAMPLES_PER_SEC) {
+
+    if (n == BLEN) {
+      memmove(bits, bits + 60*SAMPLES_PER_SEC, BLEN - 60*SAMPLES_PER_SEC);
+      engine_invalidate(0);
+      first += 60*1000000ULL;
+      n -= 60*SAMPLES_PER_SEC;
+      from = 0;
+      *frame_idx = BLEN + BLEN;
+      *min_val = SAMPLES_PER_SEC * 120 * engine->one;
+    }
+
+    fill_buffer_from(src, n, n + SAMPLES_PER_SEC, first);
+    n += SAMPLES_PER_SEC;
+    sampled += SAMPLES_PER_SEC;
+
+    if (find_frame_from(from, n, frame_idx, min_val)) {
+      decode_frame(*frame_idx);
+      if (frame_worst_score() < verdict_ok*engine->one && frame_minute() >= 0 &&
+	  *min_val < FRAME_OK*engine->one &&
+	  !frame_phase_better(*frame_idx, n, *min_val))
+	break;
+    }
+    from = n - 60*SAMPLES_PER_SEC;
+  }
+
+  *len = n;
+  return first;
+}
 
 /* decode_sec
  *
@@ -289,7 +438,7 @@ uint32_t decode_sec(uint32_t samp_idx, uint32_t *score)
  * the decode quality score in score.
  *
  * If a bit best decodes as a mark, the field decode fails.  Value returned is 0 and the
- * score is DECODE_FAILURE.  worst_score is the number of errors in the bit withih the field
+ * score is DECODE_FAILURE errors.  worst_score is the number of errors in the bit withih the field
  * that had the most errors.
  */
 
@@ -304,8 +453,8 @@ uint32_t decode_field(uint32_t frame_idx, code_t *code, uint32_t code_len, uint3
     res = decode_sec(frame_idx + code[i].bit*SAMPLES_PER_SEC, &res_score);
     if (res_score > *worst_score) *worst_score = res_score;
     if (res == 2) {
-      *score = DECODE_FAILURE;
-      *worst_score = SAMPLES_PER_SEC;
+      *score = DECODE_FAILURE*engine->one;
+      *worst_score = SAMPLES_PER_SEC*engine->one;
       return 0;
     } else {
       field_val += code[i].weight*res;
@@ -320,46 +469,36 @@ uint32_t decode_field(uint32_t frame_idx, code_t *code, uint32_t code_len, uint3
 /* Decode the frame located by seaching for the sample that produced the best
  * match to the unchanging parts of frames */
 
-uint32_t decode_frame(uint32_t frame_idx)
+/* Decode field i of the frame at frame_idx into frame[i].  Returns its
+ * score. */
+
+uint32_t decode_frame_field(uint32_t frame_idx, uint32_t i)
 {
-  uint32_t i, res, res_score, score = 0, worst_score;
+  uint32_t res_score, worst_score;
 
-  for (i = 0; i < sizeof(frame)/sizeof(frame[0]); i++) {
-    res = decode_field(frame_idx, frame[i].code, frame[i].code_len, &res_score, &worst_score);
-    frame[i].score = res_score;
-    frame[i].worst_score = worst_score;
-    score += res_score;
-    frame[i].value = res;
-  }
+  frame[i].value = decode_field(frame_idx, frame[i].code, frame[i].code_len, &res_score, &worst_score);
+  frame[i].score = res_score;
+  frame[i].worst_score = worst_score;
 
-  return score;
+  return res_score;
 }
 
-/* Display the frame with sampled bits organized by seconds within the frame.  If
- * the decode is correct, the first second will be a marker.  If the decode is
- * correct, you can see the values of each second by eye.
- *
- * A marker is 80% zeros followed by 20% ones.
- * A zero is 20% zeros followed by 80% ones.
- * A one is 50% zeros followed by 50% ones.
- *
- * Note some people may use an inverted definition.
- */
-
-void print_frame(uint32_t samp_idx)
+uint32_t decode_frame(uint32_t frame_idx)
 {
-  uint32_t i, secs, lb_mod;
-  
-  printf("   Sec Sample          Samples in Second\n");
-  printf("   --- ------  ----------------------------------------");
-
-  secs = 0;
-  lb_mod = samp_idx % SAMPLES_PER_SEC;
-  for (i = samp_idx; i < samp_idx + 60*SAMPLES_PER_SEC; i++) {
-    if (i % SAMPLES_PER_SEC == lb_mod) printf("\n   %03u (%04u): ", secs++, i);
-    printf("%u", bits[i]);
+  uint32_t i, score = 0, secs = 0;
+
+  TRACE_BEGIN("decode_frame");
+  if (perf_enabled) perf_begin(PERF_DECODE_FRAME);
+
+  for (i = 0; i < sizeof(frame)/sizeof(frame[0]); i++) {
+    score += decode_frame_field(frame_idx, i);
+    secs += frame[i].code_len;
   }
-  printf("\n");
+
+  if (perf_enabled) perf_end(PERF_DECODE_FRAME, secs);
+  TRACE_END("decode_frame");
+
+  return score;
 }
 
 void daynum_to_month_day(uint32_t daynum, uint32_t *month, uint32_t *day, uint32_t is_leap_year)
@@ -380,14 +519,184 @@ void daynum_to_month_day(uint32_t daynum, uint32_t *month, uint32_t *day, uint32
   *month += 1;
 }
 
-int main(int argc, char *argv[])
+/* Worst per-second score over all fields of the last decode_frame() */
+
+uint32_t frame_worst_score(void)
+{
+  uint32_t i, worst = 0;
+
+  for (i = 0; i < NUM_FIELDS; i++)
+    if (frame[i].worst_score > worst) worst = frame[i].worst_score;
+
+  return worst;
+}
+
+/* A score of the current engine as sample errors, for printing */
+
+uint32_t score_errors(uint32_t score)
+{
+  return score/engine->one;
+}
+
+/* Days from the start of year 2000 to the start of year 20yy */
+
+static uint32_t days_before_year(uint32_t yy)
+{
+  return 365*yy + (yy + 3)/4;
+}
+
+/* Field values vals[], indexed as frame[], as minutes since 2000-01-01 00:00
+ * UTC.  Returns -1 if they are not a valid time. */
+
+int32_t fields_minute(uint32_t *vals)
+{
+  if (vals[MINUTES] > 59 || vals[HOURS] > 23 || vals[YEAR] > 99)
+    return -1;
+  if (vals[LYI] != (vals[YEAR] % 4 == 0))
+    return -1;
+  if (vals[DAYNUM] < 1 || vals[DAYNUM] > 365 + vals[LYI])
+    return -1;
+
+  return ((days_before_year(vals[YEAR]) + vals[DAYNUM] - 1)*24 + vals[HOURS])*60 + vals[MINUTES];
+}
+
+/* Time of the last decode_frame() as minutes since 2000-01-01 00:00 UTC.  Returns
+ * -1 if any field failed to decode or the fields are not a valid time. */
+
+int32_t frame_minute(void)
+{
+  uint32_t i, vals[NUM_FIELDS];
+
+  for (i = 0; i < NUM_FIELDS; i++) {
+    if (frame[i].score == DECODE_FAILURE*engine->one) return -1;
+    vals[i] = frame[i].value;
+  }
+
+  return fields_minute(vals);
+}
+
+/* Inverse of frame_minute() */
+
+void minute_to_fields(int32_t minute, uint32_t *year, uint32_t *daynum, uint32_t *hours,
+		      uint32_t *minutes, uint32_t *lyi)
+{
+  uint32_t days = minute/(24*60);
+
+  *minutes = minute % 60;
+  *hours = (minute/60) % 24;
+  *year = 0;
+  while (days_before_year(*year + 1) <= days) *year += 1;
+  *daynum = days - days_before_year(*year) + 1;
+  *lyi = (*year % 4 == 0);
+}
+
+/* Build the 60 seconds (0, 1, or 2 for mark) WWVB sends for the given minute.
+ * Fields the decoder does not use (DUT1) are sent as zeros. */
+
+void encode_frame(int32_t minute, uint32_t lsw, uint32_t dst, uint8_t *secs)
+{
+  uint32_t i, j, val, vals[NUM_FIELDS];
+
+  for (i = 0; i < 60; i++) secs[i] = 0;
+  for (i = 0; i < sizeof(frame_const_fields)/sizeof(frame_const_fields[0]); i++)
+    secs[frame_const_fields[i].sec] = frame_const_fields[i].type;
+
+  minute_to_fields(minute, &vals[YEAR], &vals[DAYNUM], &vals[HOURS], &vals[MINUTES], &vals[LYI]);
+  vals[LSW] = lsw;
+  vals[DST] = dst;
+
+  for (i = 0; i < NUM_FIELDS; i++) {
+    val = vals[i];
+    for (j = 0; j < frame[i].code_len; j++) {
+      if (val >= frame[i].code[j].weight) {
+	secs[frame[i].code[j].bit] = 1;
+	val -= frame[i].code[j].weight;
+      }
+    }
+  }
+}
+
+/* Mark the seconds of a frame that are fixed or carry the time fields, which
+ * is all of them but DUT1, LSW, and DST */
+
+void frame_time_secs(uint8_t *known)
+{
+  uint32_t i, j;
+
+  for (i = 0; i < 60; i++) known[i] = 0;
+  for (i = 0; i < sizeof(frame_const_fields)/sizeof(frame_const_fields[0]); i++)
+    known[frame_const_fields[i].sec] = 1;
+  for (i = 0; i < NUM_FIELDS; i++) {
+    if (i == LSW || i == DST) continue;
+    for (j = 0; j < frame[i].code_len; j++) known[frame[i].code[j].bit] = 1;
+  }
+}
+
+/* Print the fields, scores, and summary of the last decode_frame() */
+
+void print_decode(uint32_t score)
 {
-  int opt, print_flag = 0;
-  uint32_t i, frame_idx, min_val, score, month, day;
-  char *infilename = NULL, *outfilename = NULL;
-  uint32_t start, end, total_code_len, frame_worst_sec_score;
+  uint32_t i, month, day, total_code_len, frame_worst_sec_score, sc[NUM_FIELDS], worst[NUM_FIELDS];
+  float mean[NUM_FIELDS];
+
+  TRACE_BEGIN("print_decode");
+  daynum_to_month_day(frame[DAYNUM].value, &month, &day, frame[LYI].value);
+
+  /* Scores in sample errors, whatever the engine's units */
+  for (i = 0; i < NUM_FIELDS; i++) {
+    sc[i] = score_errors(frame[i].score);
+    mean[i] = frame[i].score/(float)(frame[i].code_len*engine->one);
+    worst[i] = score_errors(frame[i].worst_score);
+  }
+
+  printf("  Time: %02u:%02u                  (%u/%.2f-%02u, %u/%.2f-%02u)\n",
+	 frame[HOURS].value, frame[MINUTES].value,
+	 sc[HOURS], mean[HOURS], worst[HOURS], sc[MINUTES], mean[MINUTES], worst[MINUTES]);
 
-  while ((opt = getopt(argc, argv, "i:o:ph")) != -1) {
+  printf("  Day Number: %03u of year %02u   (%u/%.2f-%02u, %u/%.2f-%02u)\n",
+	 frame[DAYNUM].value, frame[YEAR].value,
+	 sc[DAYNUM], mean[DAYNUM], worst[DAYNUM], sc[YEAR], mean[YEAR], worst[YEAR]);
+
+  printf("  LYI: %u, LSW: %u, DST: %02u      (%u/%.2f-%02u, %u/%.2f-%02u, %u/%.2f-%02u)\n",
+	 frame[LYI].value, frame[LSW].value, frame[DST].value,
+	 sc[LYI], mean[LYI], worst[LYI], sc[LSW], mean[LSW], worst[LSW], sc[DST], mean[DST], worst[DST]);
+
+  total_code_len = 0;
+  for (i = 0; i < NUM_FIELDS; i++) total_code_len += frame[i].code_len;
+  frame_worst_sec_score = frame_worst_score();
+  printf("  Total decode score %u/%.2f-%02u (lower is better)\n\n", score_errors(score),
+	 score/(float)(total_code_len*engine->one), score_errors(frame_worst_sec_score));
+  
+  printf("  Summary: %02u:%02u UT1 on %02u/%02u/20%02u - %02u ", frame[HOURS].value, frame[MINUTES].value,
+	 month, day, frame[YEAR].value, score_errors(frame_worst_sec_score));
+  if (frame_worst_sec_score < verdict_ok*engine->one)
+    printf("LIKELY OK\n");
+  else if (frame_worst_sec_score < VERDICT_UNRELIABLE*engine->one)
+    printf("NOT RELIABLE\n");
+  else
+    printf("PROBABLY BAD\n");
+  TRACE_END("print_decode");
+}
+
+/* Built without main() for check_hpp, which links the decoder */
+#ifndef WWVB_NO_MAIN
+
+static void stop_handler(int sig)
+{
+  wwvb_stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+  int opt, print_flag = 0, duty_flag = 0, verify_flag = 0, pipe_flag = 0, bench_flag = 0, check_flag = 0, loop_flag = 0, ret;
+  uint32_t frame_idx, min_val, score, interval_sec = 0, count = 0, verify_ms = 0, len, budget_usec = 0;
+  uint32_t export_usec = 0;
+  char *infilename = NULL, *outfilename = NULL, *chipname = NULL, *labeldir = NULL, *tunedir = NULL;
+  char *llrfilename = NULL, *learndir = NULL, *controlpath = NULL, *playdevice = NULL;
+  source_t *src = &gpio_source;
+  uint64_t start = 0, end = 0;
+
+  while ((opt = getopt(argc, argv, "i:o:w:W:A:plECX:L:G:S:a:r:Iq:d:n:s:H:R:F:M:D:V:e:v:Y:U:BK:T:Pt:h")) != -1) {
     switch (opt) {
     case 'i':
       infilename = optarg;
@@ -395,84 +704,365 @@ int main(int argc, char *argv[])
     case 'o':
       outfilename = optarg;
       break;
+    case 'w':
+      if (edgelog_open(optarg) < 0) exit(EXIT_FAILURE);
+      break;
+    case 'W':
+      export_usec = atoi(optarg);
+      if (export_usec < 1) {
+	fprintf(stderr, "Error: -W must be at least 1 usec\n");
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'X':
+      if (shadow_add(optarg) < 0) exit(EXIT_FAILURE);
+      break;
+    case 'S':
+      controlpath = optarg;
+      break;
+    case 'a':
+      alsa_device = optarg;
+      src = &alsa_source;
+      break;
+    case 'r':
+      alsa_rate = atoi(optarg);
+      break;
+    case 'I':
+      alsa_invert = 1;
+      break;
+    case 'q':
+      playdevice = optarg;
+      break;
+    case 'A':
+      labeldir = optarg;
+      break;
     case 'p':
       print_flag = 1;
       break;
+    case 'l':
+      live_enabled = 1;
+      break;
+    case 'E':
+      early_enabled = 1;
+      break;
+    case 'C':
+      pipe_flag = 1;
+      break;
+    case 'L':
+      loop_flag = 1;
+      budget_usec = atoi(optarg);
+      /* A slice only starts if the budget fits before the next sample */
+      if (budget_usec < 1 || budget_usec >= SAMP_PERIOD_USEC) {
+	fprintf(stderr, "Error: -L must be from 1 to %u usec\n", SAMP_PERIOD_USEC - 1);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'G':
+      chipname = optarg;
+      break;
+    case 'd':
+      duty_flag = 1;
+      interval_sec = atoi(optarg);
+      break;
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 's':
+      src = &sim_source;
+      sim_noise_pct = atoi(optarg);
+      break;
+    case 'H':
+      if (hist_load(optarg) < 0) exit(EXIT_FAILURE);
+      break;
+    case 'R':
+      refresh_sec = atoi(optarg);
+      break;
+    case 'F':
+      flywheel_print_sec = atoi(optarg);
+      break;
+    case 'M':
+      if (monitor_open(optarg) < 0) exit(EXIT_FAILURE);
+      duty_flag = 1;
+      break;
+    case 'D':
+      monitor_delay_usec = atoi(optarg)*1000;
+      break;
+    case 'V':
+      verify_flag = 1;
+      verify_ms = atoi(optarg);
+      break;
+    case 'e':
+      if ((engine = engine_find(optarg)) == NULL) {
+	fprintf(stderr, "Error: unknown engine %s, choose from: ", optarg);
+	engine_list(stderr);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'v':
+      verdict_ok = atoi(optarg);
+      if (verdict_ok < 1 || verdict_ok > SAMPLES_PER_SEC) {
+	fprintf(stderr, "Error: -v must be from 1 to %u errors\n", SAMPLES_PER_SEC);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'Y':
+      llrfilename = optarg;
+      break;
+    case 'U':
+      learndir = optarg;
+      break;
+    case 'B':
+      bench_flag = 1;
+      break;
+    case 'K':
+      check_flag = 1;
+      count = atoi(optarg);
+      break;
+    case 'T':
+      tunedir = optarg;
+      break;
+    case 'P':
+      perf_init();
+      break;
+    case 't':
+      trace_open(optarg);
+      break;
     case 'h':
     defualt:
-      fprintf(stderr, "Usage: wwvb_dec [-i in_filename] [-o out_filename] [-p]\n");
+      fprintf(stderr, "Usage: wwvb_dec [-i in_filename] [-o out_filename] [-w edge_filename] [-p] [-l] [-E] [-C [-X engines]]\n"
+	      "                [-d secs]\n"
+	      "                [-L usec [-G gpiochip]] [-S socket_path] [-A label_dir]\n"
+	      "                [-n count]\n"
+	      "                [-H hist_filename [-R secs]] [-F secs] [-M mon_filename [-D ms]]\n"
+	      "                [-V ms]\n"
+	      "                [-s noise_pct | -a alsa_device [-r rate] [-I]]\n"
+	      "                [-e engine] [-v errors] [-Y llr_filename] [-P]\n"
+	      "                [-t trace_filename]\n"
+	      "       wwvb_dec -B filename...\n"
+	      "       wwvb_dec -K count [filename...]\n"
+	      "       wwvb_dec -i edge_filename -o out_filename -W usec\n"
+	      "       wwvb_dec -T label_dir\n"
+	      "       wwvb_dec -U label_dir -Y llr_filename\n"
+	      "       wwvb_dec -s noise_pct -q alsa_device [-r rate] [-n count]\n");
       fprintf(stderr, "          -i filename  : read samples from file rather than GPIO.\n");
       fprintf(stderr, "          -o filename  : write samples to file.\n");
+      fprintf(stderr, "          -w filename  : log every edge of the receiver output to file.  A log\n"
+	      "                         given to -i is replayed as if live, sampled every\n"
+	      "                         SAMP_PERIOD ms as built.\n");
+      fprintf(stderr, "          -W usec      : convert the edge log given to -i to a sample file\n"
+	      "                         for -o, sampled every usec.\n");
       fprintf(stderr, "          -p filename  : ASCII print the frame.\n");
+      fprintf(stderr, "          -l           : ASCII print each second as it is sampled.\n");
+      fprintf(stderr, "          -E           : with -d or -L, print each field as soon as its seconds\n"
+	      "                         are sampled, once the frame start is predicted.\n");
+      fprintf(stderr, "          -C           : decode every minute, sampling without a break in a\n"
+	      "                         separate thread.\n");
+      fprintf(stderr, "          -X engines   : with -C, also decode with each of a comma separated\n"
+	      "                         list of engines and log how they compare with -e.\n");
+      fprintf(stderr, "          -L usec      : decode every minute from one thread, sleeping between\n"
+	      "                         samples and decoding (search, each field, output)\n"
+	      "                         in slices started only if usec fits before the next\n"
+	      "                         sample, 1 to %u.  Search slices are sized to usec,\n"
+	      "                         the others are short but not bounded by it.\n", SAMP_PERIOD_USEC - 1);
+      fprintf(stderr, "          -G device    : with -L, sample from the edge events of a gpiochip\n"
+	      "                         device such as /dev/gpiochip0.\n");
+      fprintf(stderr, "          -S path      : with -C or -L, answer status requests on a Unix domain\n"
+	      "                         socket at path.  dump writes beside the socket.\n");
+      fprintf(stderr, "          -A directory : decode every minute of a long recording (an edge log\n"
+	      "                         given to -i) and save the minutes that can be\n"
+	      "                         labeled with their true time to directory.\n");
+      fprintf(stderr, "          -d secs      : duty cycle, power receiver down for secs after a\n"
+	      "                         confident decode, then wake to verify one frame.\n");
+      fprintf(stderr, "          -n count     : with -d, -C, -L or -A, stop after count decodes.\n");
+      fprintf(stderr, "          -H filename  : with -d, keep decode history by hour of day in file\n"
+	      "                         and attempt decodes in the hours that usually work.\n");
+      fprintf(stderr, "          -R secs      : with -H, attempt a decode at least every secs, default\n"
+	      "                         21600, 0 for no limit.\n");
+      fprintf(stderr, "          -F secs      : with -d, print flywheel time every secs between decodes.\n");
+      fprintf(stderr, "          -M filename  : monitor the system clock against WWVB every decode,\n"
+	      "                         appending offsets to file.  Implies -d 0 if no -d.\n");
+      fprintf(stderr, "          -D ms        : with -M, receiver and propagation delay.\n");
+      fprintf(stderr, "          -V ms        : check the system clock against the next frame, within\n"
+	      "                         ms of the frame start it predicts.\n");
+      fprintf(stderr, "          -s noise_pct : sample a simulated receiver rather than GPIO.\n");
+      fprintf(stderr, "          -a device    : capture the receiver from an ALSA sound card input\n"
+	      "                         rather than GPIO (make ALSA=1).\n");
+      fprintf(stderr, "          -r rate      : with -a or -q, audio rate, default 48000.\n");
+      fprintf(stderr, "          -I           : with -a or -q, the input inverts the receiver output.\n");
+      fprintf(stderr, "          -q device    : play the simulated receiver to an ALSA device, for\n"
+	      "                         count minutes.\n");
+      fprintf(stderr, "          -e engine    : score symbols with engine: ");
+      engine_list(stderr);
+      fprintf(stderr, ".\n");
+      fprintf(stderr, "          -v errors    : accept a decode whose worst second has fewer errors,\n"
+	      "                         default %u.\n", VERDICT_OK);
+      fprintf(stderr, "          -Y filename  : error rates by position for -e llr, as learned by -U.\n");
+      fprintf(stderr, "          -U directory : learn the error rates for -e llr from a corpus labeled\n"
+	      "                         by -A, and write them to the -Y file.\n");
+      fprintf(stderr, "          -B files     : benchmark the engines on recorded sample files.\n");
+      fprintf(stderr, "          -K count     : check every engine against the reference code on any\n"
+	      "                         sample files and count generated buffers.\n");
+      fprintf(stderr, "          -T directory : search -e and -v for the best on a corpus labeled\n"
+	      "                         by -A.  Only -e and -v, the rest is fixed at build.\n");
+      fprintf(stderr, "          -P           : report time and hardware counters per decoder stage.\n");
+      fprintf(stderr, "          -t filename  : write a Chrome trace event timeline to file on exit.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+
+  if (learndir != NULL) {
+    if (llrfilename == NULL) {
+      fprintf(stderr, "Error: -U needs -Y for the table to write\n");
       exit(EXIT_FAILURE);
     }
+    return llr_learn(learndir, llrfilename) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+  if (llrfilename != NULL && llr_load(llrfilename) < 0) exit(EXIT_FAILURE);
+
+  if (bench_flag) return bench_run(argv + optind, argc - optind) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  if (check_flag) return check_run(argv + optind, argc - optind, count) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  signal(SIGINT, stop_handler);
+  signal(SIGTERM, stop_handler);
+  trace_thread_name("main");
+
+  if (shadow_enabled() && !pipe_flag) {
+    fprintf(stderr, "Error: -X needs -C\n");
+    exit(EXIT_FAILURE);
+  }
+  /* -C hands samples to the decoder a minute at a time */
+  if (early_enabled && (pipe_flag || (!duty_flag && !loop_flag))) {
+    fprintf(stderr, "Error: -E needs -d or -L\n");
+    exit(EXIT_FAILURE);
   }
 
+  if (playdevice != NULL) return alsa_play(playdevice, count) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  if (tunedir != NULL) return tune_run(tunedir) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  if (export_usec > 0) {
+    if (infilename == NULL || outfilename == NULL || !edgelog_detect(infilename)) {
+      fprintf(stderr, "Error: -W needs an edge log for -i and a file for -o\n");
+      exit(EXIT_FAILURE);
+    }
+    return edgelog_export(infilename, outfilename, export_usec) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  /* An edge log is a source rather than a sample file */
+  if (infilename != NULL && edgelog_detect(infilename)) {
+    edgelog_replay_fname = infilename;
+    src = &edgelog_source;
+    infilename = NULL;
+  }
+
+  /* Only the continuous decoders publish to the control socket */
+  if (controlpath != NULL && (infilename != NULL || verify_flag || !(pipe_flag || (loop_flag && labeldir == NULL)))) {
+    fprintf(stderr, "Error: -S needs -C or -L\n");
+    exit(EXIT_FAILURE);
+  }
 
   if (infilename == NULL) {
 
-    gpioCfgClock(5, 1, 1); /* this is defaults anyway */
+    if (src->open() < 0) return EXIT_FAILURE;
+    edgelog_start(src);
+    if (controlpath != NULL && control_open(controlpath, src) < 0) {
+      src->close();
+      edgelog_close();
+      return EXIT_FAILURE;
+    }
 
-    if (gpioInitialise()<0) {
-      fprintf(stderr, "Could not initialize GPIO library\n");
+    if (verify_flag) {
+      ret = verify_run(src, verify_ms*1000, print_flag);
+      src->close();
+      edgelog_close();
+      control_close();
+      if (outfilename != NULL) save_buffer_file(outfilename);
+      trace_dump();
+      return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (pipe_flag) {
+      ret = pipe_run(src, count, print_flag, outfilename);
+      src->close();
+      edgelog_close();
+      control_close();
+      trace_dump();
+      return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (labeldir != NULL) {
+      ret = label_run(src, count, labeldir);
+      src->close();
+      edgelog_close();
+      control_close();
+      trace_dump();
+      return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (loop_flag) {
+      ret = evloop_run(src, count, budget_usec, chipname, print_flag, outfilename);
+      src->close();
+      edgelog_close();
+      control_close();
+      trace_dump();
+      return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (duty_flag) {
+      sched_run(src, interval_sec, count, print_flag);
+      src->close();
+      edgelog_close();
+      control_close();
+      trace_dump();
+      return EXIT_SUCCESS;
+    }
+
+    /* A recording keeps the whole buffer, otherwise stop at the first
+     * confident frame */
+    if (live_enabled) live_start(-1);
+    start = src->now();
+    if (outfilename != NULL)
+      fill_buffer(src, BLEN);
+    else
+      fill_buffer_adaptive(src, &len, &frame_idx, &min_val);
+    end = src->now();
+
+    if (wwvb_stop) {
+      if (edgelog_replay_ended) fprintf(stderr, "Error: edge log ended before a frame was decoded\n");
+      src->close();
+      edgelog_close();
+      control_close();
+      trace_dump();
       return EXIT_FAILURE;
     }
-    start = gpioTick();
-    fill_buffer_gpio();
-    end = gpioTick();
   } else {
 
     fill_buffer_file(infilename);
     
   }
 
-  frame_idx = find_frame(&min_val);
+  if (infilename != NULL || outfilename != NULL) frame_idx = find_frame(BLEN, &min_val);
   printf("\nFound frame at sample %u, score %u, fill time %u usec\n", frame_idx,
-	 min_val, end - start);
+	 score_errors(min_val), (uint32_t)(end - start));
 
   if (print_flag) print_frame(frame_idx);
 
   score = decode_frame(frame_idx);
 
-  daynum_to_month_day(frame[DAYNUM].value, &month, &day, frame[LYI].value);
-
-  printf("  Time: %02u:%02u                  (%u/%.2f-%02u, %u/%.2f-%02u)\n",
-	 frame[HOURS].value, frame[MINUTES].value,
-	 frame[HOURS].score, frame[HOURS].score/(float)frame[HOURS].code_len, frame[HOURS].worst_score,
-	 frame[MINUTES].score, frame[MINUTES].score/(float)frame[MINUTES].code_len, frame[MINUTES].worst_score);
-
-  printf("  Day Number: %03u of year %02u   (%u/%.2f-%02u, %u/%.2f-%02u)\n",
-	 frame[DAYNUM].value, frame[YEAR].value,
-         frame[DAYNUM].score, frame[DAYNUM].score/(float)frame[DAYNUM].code_len, frame[DAYNUM].worst_score,
-	 frame[YEAR].score, frame[YEAR].score/(float)frame[YEAR].code_len, frame[YEAR].worst_score);
-
-  printf("  LYI: %u, LSW: %u, DST: %02u      (%u/%.2f-%02u, %u/%.2f-%02u, %u/%.2f-%02u)\n",
-	 frame[LYI].value, frame[LSW].value, frame[DST].value,
-	 frame[LYI].score, frame[LYI].score/(float)frame[LYI].code_len, frame[LYI].worst_score,
-	 frame[LSW].score, frame[LSW].score/(float)frame[LSW].code_len, frame[LSW].worst_score,
-	 frame[DST].score, frame[DST].score/(float)frame[DST].code_len, frame[DST].worst_score);
+  print_decode(score);
 
-  total_code_len = 0;
-  frame_worst_sec_score = 0;
-  for (i = 0; i < sizeof(frame)/sizeof(frame[0]); i++) {
-    if (frame[i].worst_score > frame_worst_sec_score) frame_worst_sec_score = frame[i].worst_score;
-    total_code_len += frame[i].code_len;
-  }
-  printf("  Total decode score %u/%.2f-%02u (lower is better)\n\n", score, score/(float)total_code_len,
-	 frame_worst_sec_score);
-  
-  printf("  Summary: %02u:%02u UT1 on %02u/%02u/20%02u - %02u ", frame[HOURS].value, frame[MINUTES].value,
-	 month, day, frame[YEAR].value, frame_worst_sec_score);
-  if (frame_worst_sec_score < 7)
-    printf("LIKELY OK\n");
-  else if (frame_worst_sec_score < 10)
-    printf("NOT RELIABLE\n");
-  else
-    printf("PROBABLY BAD\n");
+  if (perf_enabled) perf_report();
 
-  if (infilename == NULL) gpioTerminate();
+  if (infilename == NULL) src->close();
+  edgelog_close();
+  control_close();
 
   if (outfilename != NULL) save_buffer_file(outfilename);
+
+  trace_dump();
   
   return EXIT_SUCCESS;
 }
+
+#endif
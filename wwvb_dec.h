@@ -0,0 +1,264 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Definitions shared by the modules of wwvb_dec.
+ */
+
+#ifndef WWVB_DEC_H
+#define WWVB_DEC_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* GPIO4 is pin 7 on Raspberry PI Zero */
+#define GPIO 4
+
+/* GPIO17 is pin 11 on Raspberry PI Zero.  Drives the receiver PDN pin, high
+ * powers the receiver down. */
+#define PDN_GPIO 17
+
+/* Choose SAMP_PERIOD to evenly divide 200, 500, and 800, with a multiple of
+ * 8 samples a second for the lut engine and fewer than 64 for the bitslice
+ * engine */
+#define SAMP_PERIOD 25
+#define SAMP_PERIOD_USEC (1000*SAMP_PERIOD)
+#define BUF_LEN_IN_SEC 120
+#define SAMPLES_PER_SEC (1000/SAMP_PERIOD)
+#define BLEN (SAMPLES_PER_SEC*BUF_LEN_IN_SEC)
+
+/* Longest sampling for a confident frame, the buffer keeps the last
+ * BUF_LEN_IN_SEC of it */
+#define CAPTURE_MAX_SEC 300
+
+#define DECODE_FAILURE (9999)
+
+/* Seconds from the Unix epoch to 2000-01-01 00:00 UTC */
+#define EPOCH_2000 946684800
+
+/* Summary verdict thresholds on the worst per-second score of a frame, in
+ * errors.  VERDICT_OK is the default for -v. */
+#define VERDICT_OK 7
+#define VERDICT_UNRELIABLE 10
+
+/* Most a frame start may score on its 18 constant seconds for sampling to
+ * stop early on it */
+#define FRAME_OK (18*5)
+
+typedef struct {
+  uint32_t bit;
+  uint32_t weight;
+} code_t;
+
+typedef struct {
+  char *name;
+  uint32_t value;
+  uint32_t score;
+  uint32_t worst_score;
+  uint32_t val_width;
+  code_t *code;
+  uint32_t code_len;
+} field_t;
+
+/* Indices for frame[] */
+#define HOURS 0
+#define MINUTES 1
+#define DAYNUM 2
+#define YEAR 3
+#define LYI 4
+#define LSW 5
+#define DST 6
+#define NUM_FIELDS 7
+
+extern __thread field_t frame[NUM_FIELDS];
+extern uint8_t bits[BLEN];
+
+/* Set by SIGINT or SIGTERM, long running loops finish up when they see it */
+extern volatile int wwvb_stop;
+extern uint32_t verdict_ok;
+
+/* A source of receiver samples.  Time is in microseconds of a monotonic clock
+ * private to the source. */
+
+typedef struct {
+  char *name;
+  int (*open)(void);
+  void (*close)(void);
+  uint64_t (*now)(void);
+  uint64_t (*realtime)(void);         /* host wall clock, usec since Unix epoch */
+  void (*wait_until)(uint64_t usec);  /* busy wait, for sample timing */
+  void (*sleep)(uint64_t usec);       /* idle wait, CPU not needed */
+  uint32_t (*read)(void);             /* current level of receiver OUT */
+  void (*power)(int on);              /* drive receiver PDN */
+} source_t;
+
+extern source_t gpio_source;
+extern source_t sim_source;
+extern source_t edgelog_source;
+extern uint32_t sim_noise_pct;
+
+/* alsa.c */
+extern source_t alsa_source;
+extern char *alsa_device;
+extern uint32_t alsa_rate;
+extern int alsa_invert;
+int alsa_play(char *device, uint32_t count);
+
+/* A symbol scoring engine, see engine.c.  Symbols are 0, 1, and 2 for mark.
+ * Scores are in units of one, the score of one sample error, and thresholds
+ * on them are scaled by it. */
+
+typedef struct {
+  char *name;
+  void (*prepare)(uint32_t len);                      /* ready the first len samples */
+  uint32_t (*score)(uint32_t samp_idx, uint32_t sym);  /* errors of the second at samp_idx */
+  void (*invalidate)(uint32_t from);                  /* bits[] changed from sample from */
+  uint32_t one;                                       /* score of one error */
+} engine_t;
+
+/* wwvb_dec.c */
+void fill_buffer_file(char *fname);
+void save_buffer_file(char *fname);
+extern uint32_t fill_late_max;
+void fill_buffer_from(source_t *src, uint32_t start, uint32_t len, uint64_t first_tick);
+uint64_t fill_buffer(source_t *src, uint32_t len);
+uint64_t fill_realtime(uint64_t t);
+uint32_t xor_sec(uint32_t samp_idx, uint32_t zero_len, uint32_t one_len);
+uint32_t xor_mark(uint32_t samp_idx);
+uint32_t xor_zero(uint32_t samp_idx);
+uint32_t xor_one(uint32_t samp_idx);
+uint32_t xor_frame(uint32_t samp_idx, uint32_t min_val);
+uint32_t find_frame(uint32_t len, uint32_t *min_val);
+int find_frame_from(uint32_t from, uint32_t len, uint32_t *min_idx, uint32_t *min_val);
+uint64_t fill_buffer_adaptive(source_t *src, uint32_t *len, uint32_t *frame_idx, uint32_t *min_val);
+uint32_t decode_sec(uint32_t samp_idx, uint32_t *score);
+uint32_t decode_field(uint32_t frame_idx, code_t *code, uint32_t code_len, uint32_t *score,
+		      uint32_t *worst_score);
+uint32_t decode_frame_field(uint32_t frame_idx, uint32_t i);
+uint32_t decode_frame(uint32_t frame_idx);
+uint32_t frame_worst_score(void);
+uint32_t score_errors(uint32_t score);
+int32_t fields_minute(uint32_t *vals);
+int32_t frame_minute(void);
+void print_decode(uint32_t score);
+void minute_to_fields(int32_t minute, uint32_t *year, uint32_t *daynum, uint32_t *hours,
+		      uint32_t *minutes, uint32_t *lyi);
+void encode_frame(int32_t minute, uint32_t lsw, uint32_t dst, uint8_t *secs);
+void frame_time_secs(uint8_t *known);
+
+/* engine.c */
+extern __thread engine_t *engine;
+extern engine_t xor_engine, cache_engine, bitslice_engine, lut_engine;
+engine_t *engine_find(char *name);
+engine_t *engine_nth(uint32_t i);
+void engine_list(FILE *fp);
+void engine_invalidate(uint32_t from);
+
+/* llr.c */
+extern engine_t llr_engine;
+extern int llr_loaded;
+int llr_load(char *fname);
+int llr_learn(char *dir, char *fname);
+
+/* bench.c */
+int bench_run(char **fnames, uint32_t nfiles);
+
+/* evloop.c */
+int evloop_run(source_t *src, uint32_t count, uint32_t budget_usec, char *chipname, int print_flag,
+	       char *outfilename);
+
+/* label.c */
+int label_run(source_t *src, uint32_t count, char *dir);
+
+/* tune.c */
+int tune_run(char *dir);
+
+/* control.c */
+int control_open(char *path, source_t *src);
+int control_start(void);
+int control_epoll(int epfd);
+int control_event(int fd);
+void control_decode(uint32_t seq, uint64_t local, uint32_t frame_idx, uint32_t min_val,
+		    uint32_t score, uint32_t late_max, uint32_t missed);
+void control_close(void);
+
+/* shadow.c */
+int shadow_add(char *names);
+int shadow_enabled(void);
+int shadow_start(void);
+void shadow_begin(void);
+void shadow_end(uint32_t frame_idx, uint64_t nsec);
+void shadow_stop(void);
+uint64_t shadow_cpu_nsec(void);
+
+/* check.c */
+#define CHECK_KINDS 3
+int check_run(char **fnames, uint32_t nfiles, uint32_t count);
+void check_generate(uint32_t kind);
+
+/* edgelog.c */
+extern int edgelog_enabled;
+extern char *edgelog_replay_fname;
+extern int edgelog_replay_ended;
+int edgelog_open(char *fname);
+void edgelog_start(source_t *src);
+void edgelog_edge(uint64_t usec, uint32_t level);
+void edgelog_close(void);
+int edgelog_detect(char *fname);
+int edgelog_export(char *fname, char *outname, uint32_t period_usec);
+
+/* render.c */
+extern int live_enabled;
+void print_frame(uint32_t samp_idx);
+void live_start(int32_t frame_idx);
+void live_sample(uint32_t i);
+
+/* early.c */
+extern int early_enabled;
+void early_start(int32_t frame_idx);
+void early_sample(uint32_t i);
+
+/* flywheel.c */
+int flywheel_now(uint64_t local, uint64_t *utc, uint64_t *unc);
+void flywheel_update(uint64_t local, int32_t minute);
+void flywheel_print(uint64_t local);
+void flywheel_reset(void);
+
+/* monitor.c */
+extern uint32_t monitor_delay_usec;
+int monitor_open(char *fname);
+int monitor_enabled(void);
+void monitor_frame(uint64_t first, uint32_t frame_idx, int32_t minute, uint32_t worst);
+
+/* verify.c */
+int verify_run(source_t *src, uint32_t window_usec, int print_flag);
+
+/* pipe.c */
+int pipe_run(source_t *src, uint32_t count, int print_flag, char *outfilename);
+
+/* sched.c */
+void sched_run(source_t *src, uint32_t interval_sec, uint32_t count, int print_flag);
+int hist_load(char *fname);
+extern uint32_t refresh_sec;
+extern uint32_t flywheel_print_sec;
+
+/* perf.c */
+#define PERF_FIND_FRAME 0
+#define PERF_DECODE_FRAME 1
+extern __thread int perf_enabled;
+void perf_init(void);
+void perf_begin(uint32_t stage);
+void perf_end(uint32_t stage, uint32_t inner_calls);
+void perf_report(void);
+
+/* trace.c */
+extern int trace_enabled;
+int trace_open(char *fname);
+void trace_thread_name(const char *name);
+void trace_event(const char *name, char ph);
+void trace_dump(void);
+
+#define TRACE_BEGIN(name) do { if (__builtin_expect(trace_enabled, 0)) trace_event(name, 'B'); } while (0)
+#define TRACE_END(name) do { if (__builtin_expect(trace_enabled, 0)) trace_event(name, 'E'); } while (0)
+
+#endif
@@ -0,0 +1,293 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Header-only C++20 interface to the decoder, for programs that keep their
+ * own sample buffers.  It does not use the C globals (bits[], frame[]) or any
+ * of the C sources: the frame layout is constexpr tables, buffers are passed
+ * as std::span<const uint8_t> of 0/1 samples and never copied, and results
+ * are returned by value, so any number of buffers can be decoded at once from
+ * different threads.
+ *
+ * The sample period is a template parameter, so the symbol scoring loops have
+ * constant trip counts and the compiler can unroll and vectorize them for the
+ * rate in use.  Search, tie breaking (first best start wins) and decoding are
+ * those of find_frame() and decode_frame() with -e xor.
+ *
+ *   auto d = wwvb::Decoder<>::decode(samples);
+ *   if (d && d->worst_score() < wwvb::verdict_ok) use(d->minute());
+ */
+
+#ifndef WWVB_DEC_HPP
+#define WWVB_DEC_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace wwvb {
+
+/* Symbols, as in the C code: 0, 1, and 2 for a marker */
+enum class Sym : uint8_t { zero = 0, one = 1, mark = 2 };
+
+struct Code {
+  uint32_t bit;     /* second of the frame */
+  uint32_t weight;
+};
+
+struct Field {
+  std::string_view name;
+  uint32_t val_width;
+  std::span<const Code> code;
+};
+
+struct ConstSec {
+  Sym type;         /* zero or mark */
+  uint32_t sec;
+};
+
+inline constexpr uint32_t decode_failure = 9999;
+inline constexpr uint32_t verdict_ok = 7;
+inline constexpr uint32_t verdict_unreliable = 10;
+
+inline constexpr std::array<Code, 7> minutes_code{{{1, 40}, {2, 20}, {3, 10}, {5, 8}, {6, 4}, {7, 2}, {8, 1}}};
+inline constexpr std::array<Code, 6> hours_code{{{12, 20}, {13, 10}, {15, 8}, {16, 4}, {17, 2}, {18, 1}}};
+inline constexpr std::array<Code, 10> day_code{{{22, 200}, {23, 100}, {25, 80}, {26, 40}, {27, 20}, {28, 10},
+						{30, 8}, {31, 4}, {32, 2}, {33, 1}}};
+inline constexpr std::array<Code, 8> year_code{{{45, 80}, {46, 40}, {47, 20}, {48, 10}, {50, 8}, {51, 4},
+						{52, 2}, {53, 1}}};
+inline constexpr std::array<Code, 1> lyi_code{{{55, 1}}};
+inline constexpr std::array<Code, 1> lsw_code{{{56, 1}}};
+inline constexpr std::array<Code, 2> dst_code{{{57, 2}, {58, 1}}};
+
+/* Indices for frame_fields, as for frame[] */
+enum FieldIndex : std::size_t { hours, minutes, daynum, year, lyi, lsw, dst, num_fields };
+
+inline constexpr std::array<Field, num_fields> frame_fields{{
+  {"hours", 2, hours_code},
+  {"minutes", 2, minutes_code},
+  {"day", 3, day_code},
+  {"year", 2, year_code},
+  {"lyi", 1, lyi_code},
+  {"lsw", 1, lsw_code},
+  {"dst", 2, dst_code},
+}};
+
+/* The seconds with a fixed value, which the frame search scores */
+inline constexpr std::array<ConstSec, 18> frame_const_fields{{
+  {Sym::mark, 0}, {Sym::zero, 4}, {Sym::mark, 9}, {Sym::zero, 10}, {Sym::zero, 11},
+  {Sym::zero, 14}, {Sym::mark, 19}, {Sym::zero, 20}, {Sym::zero, 21}, {Sym::zero, 24},
+  {Sym::mark, 29}, {Sym::zero, 34}, {Sym::zero, 35}, {Sym::mark, 39}, {Sym::zero, 44},
+  {Sym::mark, 49}, {Sym::zero, 54}, {Sym::mark, 59},
+}};
+
+/* Days from the start of year 2000 to the start of year 20yy */
+constexpr uint32_t days_before_year(uint32_t yy)
+{
+  return 365*yy + (yy + 3)/4;
+}
+
+/* The 60 seconds WWVB sends for minute (since 2000-01-01 00:00 UTC), as
+ * encode_frame().  DUT1 is sent as zeros. */
+constexpr std::array<Sym, 60> encode_frame(int32_t minute, uint32_t lsw_val = 0, uint32_t dst_val = 0)
+{
+  std::array<Sym, 60> secs{};
+  std::array<uint32_t, num_fields> vals{};
+  uint32_t days = minute/(24*60), yy = 0;
+
+  for (auto &s : secs) s = Sym::zero;
+  for (const auto &c : frame_const_fields) secs[c.sec] = c.type;
+
+  while (days_before_year(yy + 1) <= days) yy++;
+  vals[minutes] = minute % 60;
+  vals[hours] = minute/60 % 24;
+  vals[year] = yy;
+  vals[daynum] = days - days_before_year(yy) + 1;
+  vals[lyi] = yy % 4 == 0;
+  vals[lsw] = lsw_val;
+  vals[dst] = dst_val;
+
+  for (std::size_t i = 0; i < num_fields; i++) {
+    uint32_t val = vals[i];
+    for (const auto &c : frame_fields[i].code) {
+      if (val >= c.weight) {
+	secs[c.bit] = Sym::one;
+	val -= c.weight;
+      }
+    }
+  }
+
+  return secs;
+}
+
+struct FieldResult {
+  uint32_t value = 0;
+  uint32_t score = decode_failure;    /* errors over the field's seconds */
+  uint32_t worst_score = 0;           /* errors in its worst second */
+
+  constexpr bool failed() const { return score == decode_failure; }
+};
+
+struct Decode {
+  uint32_t frame_idx = 0;             /* sample the frame starts at */
+  uint32_t min_val = 0;               /* frame search score */
+  uint32_t score = 0;                 /* sum of the field scores */
+  std::array<FieldResult, num_fields> fields{};
+
+  constexpr uint32_t worst_score() const
+  {
+    uint32_t worst = 0;
+    for (const auto &f : fields) worst = f.worst_score > worst ? f.worst_score : worst;
+    return worst;
+  }
+
+  /* Minutes since 2000-01-01 00:00 UTC, or -1 if a field failed or the
+   * fields are not a valid time, as frame_minute() */
+  constexpr int32_t minute() const
+  {
+    for (const auto &f : fields) if (f.failed()) return -1;
+    if (fields[minutes].value > 59 || fields[hours].value > 23 || fields[year].value > 99) return -1;
+    if (fields[lyi].value != (fields[year].value % 4 == 0)) return -1;
+    if (fields[daynum].value < 1 || fields[daynum].value > 365 + fields[lyi].value) return -1;
+    return ((days_before_year(fields[year].value) + fields[daynum].value - 1)*24 +
+	    fields[hours].value)*60 + fields[minutes].value;
+  }
+};
+
+struct Frame {
+  uint32_t frame_idx;
+  uint32_t min_val;
+};
+
+/* SampPeriod in ms must evenly divide 200, 500, and 800 */
+template <uint32_t SampPeriod = 25>
+class Decoder {
+  static_assert(SampPeriod > 0 && 200 % SampPeriod == 0 && 500 % SampPeriod == 0 &&
+		800 % SampPeriod == 0, "SampPeriod must evenly divide 200, 500, and 800");
+
+public:
+  static constexpr uint32_t samples_per_sec = 1000/SampPeriod;
+  static constexpr uint32_t samples_per_frame = 60*samples_per_sec;
+
+  /* Errors of the second starting at samp_idx against symbol S: ones while
+   * the carrier should be reduced, zeros after.  samp_idx + samples_per_sec
+   * must be within the buffer. */
+  template <Sym S>
+  static constexpr uint32_t score_sec(std::span<const uint8_t> s, std::size_t samp_idx)
+  {
+    constexpr uint32_t low = (S == Sym::zero ? 200 : S == Sym::one ? 500 : 800)/SampPeriod;
+    const uint8_t *p = s.data() + samp_idx;
+    uint32_t sum = 0;
+
+    for (uint32_t i = 0; i < low; i++) sum += p[i];
+    for (uint32_t i = low; i < samples_per_sec; i++) sum += p[i] ^ 1;
+
+    return sum;
+  }
+
+  /* Errors of the fixed seconds of a frame starting at samp_idx, stopping once
+   * over min_val, as xor_frame() */
+  static constexpr uint32_t score_frame(std::span<const uint8_t> s, std::size_t samp_idx,
+					uint32_t min_val = UINT32_MAX)
+  {
+    uint32_t sum = 0;
+
+    for (const auto &c : frame_const_fields) {
+      std::size_t idx = samp_idx + c.sec*samples_per_sec;
+      sum += c.type == Sym::mark ? score_sec<Sym::mark>(s, idx) : score_sec<Sym::zero>(s, idx);
+      if (sum > min_val) return sum;
+    }
+
+    return sum;
+  }
+
+  /* Best frame start, the first if several score the same.  Empty if the
+   * buffer is too short to hold a frame. */
+  static constexpr std::optional<Frame> find_frame(std::span<const uint8_t> s)
+  {
+    std::optional<Frame> best;
+    uint32_t lmin = samples_per_sec*120;
+
+    for (std::size_t i = 0; i + samples_per_frame < s.size(); i++) {
+      uint32_t res = score_frame(s, i, lmin);
+      if (res < lmin) {
+	lmin = res;
+	best = Frame{static_cast<uint32_t>(i), res};
+      }
+    }
+
+    return best;
+  }
+
+  /* Best symbol for the second at samp_idx and its errors, as decode_sec() */
+  static constexpr Sym decode_sec(std::span<const uint8_t> s, std::size_t samp_idx, uint32_t &score)
+  {
+    uint32_t zero_score = score_sec<Sym::zero>(s, samp_idx);
+    uint32_t one_score = score_sec<Sym::one>(s, samp_idx);
+    uint32_t mark_score = score_sec<Sym::mark>(s, samp_idx);
+    Sym best = Sym::zero;
+
+    score = zero_score;
+    if (one_score < zero_score) {
+      best = Sym::one;
+      score = one_score;
+    }
+    if (mark_score < score) {
+      best = Sym::mark;
+      score = mark_score;
+    }
+
+    return best;
+  }
+
+  /* A field of the frame starting at frame_idx.  A second that decodes as a
+   * marker fails the field. */
+  static constexpr FieldResult decode_field(std::span<const uint8_t> s, std::size_t frame_idx,
+					    const Field &field)
+  {
+    FieldResult r{0, 0, 0};
+    uint32_t sec_score;
+
+    for (const auto &c : field.code) {
+      Sym sym = decode_sec(s, frame_idx + c.bit*samples_per_sec, sec_score);
+      if (sec_score > r.worst_score) r.worst_score = sec_score;
+      if (sym == Sym::mark) return FieldResult{0, decode_failure, samples_per_sec};
+      r.value += c.weight*static_cast<uint32_t>(sym);
+      r.score += sec_score;
+    }
+
+    return r;
+  }
+
+  /* Every field of the frame at f.  Empty if the frame does not fit in the
+   * buffer. */
+  static constexpr std::optional<Decode> decode_frame(std::span<const uint8_t> s, Frame f)
+  {
+    Decode d;
+
+    if (f.frame_idx + std::size_t{samples_per_frame} > s.size()) return std::nullopt;
+
+    d.frame_idx = f.frame_idx;
+    d.min_val = f.min_val;
+    for (std::size_t i = 0; i < num_fields; i++) {
+      d.fields[i] = decode_field(s, f.frame_idx, frame_fields[i]);
+      d.score += d.fields[i].score;
+    }
+
+    return d;
+  }
+
+  /* Search and decode, as wwvb_dec -i */
+  static constexpr std::optional<Decode> decode(std::span<const uint8_t> s)
+  {
+    auto f = find_frame(s);
+    return f ? decode_frame(s, *f) : std::nullopt;
+  }
+};
+
+}  // namespace wwvb
+
+#endif
@@ -0,0 +1,264 @@
+/* wwvb_dec
+ * Copyright Peter Newton, 2022
+ * License (SPDX code): BSD-2-Clause
+ *
+ * Python extension module wwvb, built on wwvb_dec.hpp by "make python".
+ * Samples are taken from any object with the buffer protocol (bytes,
+ * bytearray, array.array('B'), numpy uint8 or bool arrays, mmap) of one byte
+ * 0/1 items, without copying, and decoding runs with the GIL released so
+ * threads decode in parallel.
+ *
+ *   wwvb.find_frame(buf, period_ms=25)    (frame_idx, score) or None
+ *   wwvb.decode(buf, period_ms=25)        dict of results or None
+ *   wwvb.decode_batch(bufs, period_ms=25) list of decode() results, for a
+ *                                         sequence of buffers or the rows of
+ *                                         a 2-d array
+ *
+ * A decode is a flat dict, so a list of them makes a pandas DataFrame: the
+ * frame_idx, min_val (search score), score, worst_score, and minute (since
+ * 2000, -1 if not a valid time) of the frame, and for each field its value
+ * and <field>_score and <field>_worst.  A failed field has score 9999.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <string>
+#include <vector>
+
+#include "wwvb_dec.hpp"
+
+namespace {
+
+/* Result of one buffer, set with the GIL released */
+struct Job {
+  Py_buffer view{};
+  std::optional<wwvb::Decode> decode;
+  std::optional<wwvb::Frame> frame;
+};
+
+template <uint32_t P>
+void run(Job &j, bool find_only)
+{
+  std::span<const uint8_t> s(static_cast<const uint8_t *>(j.view.buf), j.view.len);
+
+  if (find_only)
+    j.frame = wwvb::Decoder<P>::find_frame(s);
+  else
+    j.decode = wwvb::Decoder<P>::decode(s);
+}
+
+/* Periods that evenly divide 200, 500, and 800 ms */
+void run_period(Job &j, long period_ms, bool find_only)
+{
+  switch (period_ms) {
+  case 1: run<1>(j, find_only); break;
+  case 2: run<2>(j, find_only); break;
+  case 4: run<4>(j, find_only); break;
+  case 5: run<5>(j, find_only); break;
+  case 10: run<10>(j, find_only); break;
+  case 20: run<20>(j, find_only); break;
+  case 25: run<25>(j, find_only); break;
+  case 50: run<50>(j, find_only); break;
+  case 100: run<100>(j, find_only); break;
+  }
+}
+
+bool check_period(long period_ms)
+{
+  if (period_ms > 0 && 200 % period_ms == 0 && 500 % period_ms == 0 && 800 % period_ms == 0)
+    return true;
+  PyErr_Format(PyExc_ValueError, "period_ms %ld does not evenly divide 200, 500, and 800", period_ms);
+  return false;
+}
+
+/* Whether the items of a view are one byte integers or bools, uint8, int8
+ * or bool */
+bool byte_items(const Py_buffer *view)
+{
+  std::string fmt = view->format != nullptr ? view->format : "B";
+
+  return view->itemsize == 1 && (fmt == "B" || fmt == "b" || fmt == "?");
+}
+
+/* A 1-d contiguous view of one byte items */
+bool get_view(PyObject *obj, Py_buffer *view)
+{
+  if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) return false;
+  if (view->ndim != 1 || !byte_items(view)) {
+    PyErr_SetString(PyExc_TypeError, "samples must be a 1-d buffer of uint8, int8 or bool 0/1 items");
+    PyBuffer_Release(view);
+    return false;
+  }
+  return true;
+}
+
+bool set_item(PyObject *dict, const char *key, long val)
+{
+  PyObject *v = PyLong_FromLong(val);
+
+  if (v == nullptr) return false;
+  int r = PyDict_SetItemString(dict, key, v);
+  Py_DECREF(v);
+  return r == 0;
+}
+
+PyObject *decode_to_dict(const std::optional<wwvb::Decode> &d)
+{
+  if (!d) Py_RETURN_NONE;
+
+  PyObject *dict = PyDict_New();
+  bool ok = dict != nullptr &&
+    set_item(dict, "frame_idx", d->frame_idx) && set_item(dict, "min_val", d->min_val) &&
+    set_item(dict, "score", d->score) && set_item(dict, "worst_score", d->worst_score()) &&
+    set_item(dict, "minute", d->minute());
+
+  for (std::size_t i = 0; ok && i < wwvb::num_fields; i++) {
+    std::string name(wwvb::frame_fields[i].name);
+    ok = set_item(dict, name.c_str(), d->fields[i].value) &&
+      set_item(dict, (name + "_score").c_str(), d->fields[i].score) &&
+      set_item(dict, (name + "_worst").c_str(), d->fields[i].worst_score);
+  }
+  if (!ok) {
+    Py_XDECREF(dict);
+    return nullptr;
+  }
+
+  return dict;
+}
+
+PyObject *py_find_frame(PyObject *, PyObject *args, PyObject *kwds)
+{
+  static const char *kwlist[] = {"buf", "period_ms", nullptr};
+  PyObject *obj;
+  long period_ms = 25;
+  Job j;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|l", const_cast<char **>(kwlist), &obj, &period_ms) ||
+      !check_period(period_ms) || !get_view(obj, &j.view))
+    return nullptr;
+
+  Py_BEGIN_ALLOW_THREADS
+  run_period(j, period_ms, true);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&j.view);
+
+  if (!j.frame) Py_RETURN_NONE;
+  return Py_BuildValue("(kk)", (unsigned long)j.frame->frame_idx, (unsigned long)j.frame->min_val);
+}
+
+PyObject *py_decode(PyObject *, PyObject *args, PyObject *kwds)
+{
+  static const char *kwlist[] = {"buf", "period_ms", nullptr};
+  PyObject *obj;
+  long period_ms = 25;
+  Job j;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|l", const_cast<char **>(kwlist), &obj, &period_ms) ||
+      !check_period(period_ms) || !get_view(obj, &j.view))
+    return nullptr;
+
+  Py_BEGIN_ALLOW_THREADS
+  run_period(j, period_ms, false);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&j.view);
+
+  return decode_to_dict(j.decode);
+}
+
+/* The rows of a 2-d buffer are views into the one Py_buffer of the whole,
+ * which is released in place of theirs */
+PyObject *py_decode_batch(PyObject *, PyObject *args, PyObject *kwds)
+{
+  static const char *kwlist[] = {"bufs", "period_ms", nullptr};
+  PyObject *obj, *seq, *list;
+  long period_ms = 25;
+  Py_buffer whole{};
+  std::vector<Job> jobs;
+  bool rows = false, ok = true;
+  Py_ssize_t i, n;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|l", const_cast<char **>(kwlist), &obj, &period_ms) ||
+      !check_period(period_ms))
+    return nullptr;
+
+  if (PyObject_CheckBuffer(obj) && PyObject_GetBuffer(obj, &whole, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == 0) {
+    if (whole.ndim != 2) {
+      PyBuffer_Release(&whole);
+      PyErr_SetString(PyExc_TypeError, "decode_batch takes a sequence of buffers or a 2-d array");
+      return nullptr;
+    }
+    if (!byte_items(&whole)) {
+      PyBuffer_Release(&whole);
+      PyErr_SetString(PyExc_TypeError, "samples must be a 2-d array of uint8, int8 or bool 0/1 items");
+      return nullptr;
+    }
+    rows = true;
+    jobs.resize(whole.shape[0]);
+    for (i = 0; i < whole.shape[0]; i++) {
+      jobs[i].view.buf = static_cast<uint8_t *>(whole.buf) + i*whole.shape[1];
+      jobs[i].view.len = whole.shape[1];
+    }
+  } else {
+    PyErr_Clear();
+    if ((seq = PySequence_Fast(obj, "decode_batch takes a sequence of buffers or a 2-d array")) == nullptr)
+      return nullptr;
+    n = PySequence_Fast_GET_SIZE(seq);
+    jobs.resize(n);
+    for (i = 0; i < n && ok; i++) {
+      ok = get_view(PySequence_Fast_GET_ITEM(seq, i), &jobs[i].view);
+      if (!ok) jobs.resize(i);
+    }
+    Py_DECREF(seq);
+  }
+
+  if (ok) {
+    Py_BEGIN_ALLOW_THREADS
+    for (auto &j : jobs) run_period(j, period_ms, false);
+    Py_END_ALLOW_THREADS
+  }
+
+  if (rows)
+    PyBuffer_Release(&whole);
+  else
+    for (auto &j : jobs) PyBuffer_Release(&j.view);
+  if (!ok) return nullptr;
+
+  if ((list = PyList_New(jobs.size())) == nullptr) return nullptr;
+  for (i = 0; i < (Py_ssize_t)jobs.size(); i++) {
+    PyObject *d = decode_to_dict(jobs[i].decode);
+    if (d == nullptr) {
+      Py_DECREF(list);
+      return nullptr;
+    }
+    PyList_SET_ITEM(list, i, d);
+  }
+
+  return list;
+}
+
+PyMethodDef wwvb_methods[] = {
+  {"find_frame", (PyCFunction)(void (*)(void))py_find_frame, METH_VARARGS | METH_KEYWORDS,
+   "find_frame(buf, period_ms=25) -> (frame_idx, score) or None\n\n"
+   "Best frame start in a buffer of 0/1 samples, the first of equal scores."},
+  {"decode", (PyCFunction)(void (*)(void))py_decode, METH_VARARGS | METH_KEYWORDS,
+   "decode(buf, period_ms=25) -> dict or None\n\n"
+   "Find and decode the frame in a buffer of 0/1 samples, as wwvb_dec -i."},
+  {"decode_batch", (PyCFunction)(void (*)(void))py_decode_batch, METH_VARARGS | METH_KEYWORDS,
+   "decode_batch(bufs, period_ms=25) -> list\n\n"
+   "decode() each of a sequence of buffers, or each row of a 2-d array,\n"
+   "with the GIL released for the whole batch."},
+  {nullptr, nullptr, 0, nullptr}
+};
+
+PyModuleDef wwvb_module = {
+  PyModuleDef_HEAD_INIT, "wwvb", "WWVB time code frame search and decode.", -1, wwvb_methods,
+  nullptr, nullptr, nullptr, nullptr
+};
+
+}  // namespace
+
+PyMODINIT_FUNC PyInit_wwvb(void)
+{
+  return PyModule_Create(&wwvb_module);
+}